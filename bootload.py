@@ -2,6 +2,554 @@
 
 import serial
 
+USB_VID = 0xFFFE
+USB_PID = 0x000A
+
+# Custom record types
+RECORD_ERASE_AHEAD = 0x26
+RECORD_ERASE_RANGE = 0x27
+RECORD_PAGE_STATE = 0x28
+RECORD_DEVICE_INFO = 0x29
+RECORD_RAM_DATA = 0x2A
+RECORD_RAM_RUN = 0x2B
+RECORD_STATUS_MODE = 0x2C
+RECORD_SET_SERIAL = 0x2D
+RECORD_STATS = 0x2E
+RECORD_TRACE = 0x2F
+RECORD_LINKTEST = 0x30
+
+# Link test modes and the packet size the device works in, see usb.h
+LINKTEST_SINK = 0
+LINKTEST_ECHO = 1
+LINKTEST_SOURCE = 2
+LINKTEST_PACKET = 64
+
+# The bootloader's performance counters count time in sleep timer ticks. The
+# sleep timer runs from the 32 kHz RC oscillator (clock_init() doesn't select
+# a 32.768 kHz crystal), nominally 32.000 kHz on a 48 MHz CC1111.
+STATS_TICK_HZ = 32000.0
+
+# Trace timestamps are Timer 1 counts at the 187.5 kHz timer tick, see trace.h
+TRACE_TICK_US = 1e6 / 187500
+trace_events = {
+  0x01 : ("idle", None),
+  0x02 : ("record", "type %02X"),
+  0x03 : ("checked", "result %c"),
+  0x04 : ("ack", "result %c"),
+  0x05 : ("erase start", "page %d"),
+  0x06 : ("erase end", None),
+  0x07 : ("write start", "page %d"),
+  0x08 : ("write end", None)
+}
+
+# Record results sent on the interrupt endpoint, see USB_NOTIFY_STATUS in usb.h
+USB_NOTIFY_STATUS = 0xCB
+
+# Vendor control requests, see usb.h
+VENDOR_REQ_STATUS = 0x01
+VENDOR_REQ_ABORT = 0x02
+VENDOR_REQ_ERASE_RANGE = 0x03
+VENDOR_REQ_RUN = 0x04
+
+# Baud rate for serial ports, only matters if the bootloader is on a UART (see
+# UART_BAUD_M in uart.h), the USB CDC port ignores it
+SERIAL_BAUD = 1000000
+
+# Capture files written by --capture: CAPTURE_MAGIC, then per event a header
+# (op, start and duration in us, argument, data length) and the data
+CAPTURE_MAGIC = "CCBCAP1\n"
+CAPTURE_HEADER = '<cIIHI'
+capture_ops = {
+  'W' : "write",
+  'R' : "read",
+  'L' : "readline",
+  'A' : "ack",
+  'V' : "vendor request",
+  'S' : "vendor status"
+}
+
+# Setting this baud rate while the payload runs resets into the bootloader,
+# see BOOTLOADER_TOUCH_RATE in main.h
+BOOTLOADER_TOUCH_RATE = 1200
+
+# Where test code can be loaded into RAM, see RAM_CODE_BASE in main.h
+RAM_CODE_BASE = 0xF400
+RAM_CODE_END = 0xFE00
+
+class UsbTransport:
+  """
+  Talks to the bootloader's bulk endpoints through libusb (pyusb), bypassing
+  the kernel's CDC ACM/tty layer. Uses the vendor specific interface if the
+  bootloader was built with USB_VENDOR_BULK, otherwise the bulk endpoints of
+  the CDC data interface, detaching the cdc_acm driver while in use. Behaves
+  enough like a pySerial port for the rest of this script.
+  """
+  def __init__(self, serial_number=None, bus_address=None, timeout=1):
+    import usb.core
+    import usb.util
+    self.usb = usb
+    self.timeout = int(timeout * 1000)
+    self.rx_buff = ""
+    self.detached = []
+    self.status_ep = None
+    self.status_seq = None
+    self.committed_page = None
+
+    devices = usb.core.find(find_all=True, idVendor=USB_VID, idProduct=USB_PID)
+    self.dev = None
+    for dev in devices:
+      if bus_address is not None and (dev.bus, dev.address) != bus_address:
+        continue
+      if serial_number is not None and \
+         usb.util.get_string(dev, dev.iSerialNumber) != serial_number:
+        continue
+      self.dev = dev
+      break
+    if self.dev is None:
+      raise IOError("No CC Bootloader USB device found")
+
+    cfg = self.dev.get_active_configuration()
+    intf = usb.util.find_descriptor(cfg, bInterfaceClass=0xFF)
+    if intf is None:
+      # No vendor interface, take the CDC interfaces away from the kernel
+      for i in (0, 1):
+        if self.dev.is_kernel_driver_active(i):
+          self.dev.detach_kernel_driver(i)
+          self.detached.append(i)
+      intf = usb.util.find_descriptor(cfg, bInterfaceClass=0x0A)
+    self.intf = intf.bInterfaceNumber
+    usb.util.claim_interface(self.dev, self.intf)
+    self.ep_out = usb.util.find_descriptor(intf, custom_match = lambda e: \
+      usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_OUT)
+    self.ep_in = usb.util.find_descriptor(intf, custom_match = lambda e: \
+      usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_IN)
+
+  def write(self, data):
+    return self.ep_out.write(data, self.timeout)
+
+  def _fill(self):
+    try:
+      data = self.ep_in.read(self.ep_in.wMaxPacketSize, self.timeout)
+    except self.usb.core.USBError:
+      # Timed out, like a pySerial read we just return what we have
+      return False
+    self.rx_buff += data.tostring()
+    return True
+
+  def read(self, size=1):
+    while len(self.rx_buff) < size:
+      if not self._fill():
+        break
+    data = self.rx_buff[:size]
+    self.rx_buff = self.rx_buff[size:]
+    return data
+
+  def readline(self):
+    while '\n' not in self.rx_buff:
+      if not self._fill():
+        break
+    i = self.rx_buff.find('\n') + 1
+    if i == 0:
+      i = len(self.rx_buff)
+    line = self.rx_buff[:i]
+    self.rx_buff = self.rx_buff[i:]
+    return line
+
+  def __iter__(self):
+    while True:
+      line = self.readline()
+      if not line:
+        return
+      yield line
+
+  def enable_status(self):
+    # Have record results sent as notifications on the CDC interrupt endpoint
+    # so the bulk IN pipe only carries data. Needs the CDC control interface
+    # away from the kernel, older bootloaders just answer Bad Record Type.
+    usb = self.usb
+    try:
+      cfg = self.dev.get_active_configuration()
+      intf = usb.util.find_descriptor(cfg, bInterfaceClass=0x02)
+      if self.dev.is_kernel_driver_active(intf.bInterfaceNumber):
+        self.dev.detach_kernel_driver(intf.bInterfaceNumber)
+        self.detached.append(intf.bInterfaceNumber)
+      usb.util.claim_interface(self.dev, intf.bInterfaceNumber)
+    except usb.core.USBError:
+      return False
+    self.write(ihx_record(RECORD_STATUS_MODE, 0, [1]))
+    if self.read() != '0':
+      usb.util.release_interface(self.dev, intf.bInterfaceNumber)
+      return False
+    self.status_intf = intf.bInterfaceNumber
+    self.status_ep = intf[0]
+    self.status_seq = None
+    return True
+
+  def read_ack(self):
+    # Next record result from the interrupt endpoint, '' on timeout
+    while True:
+      try:
+        data = self.status_ep.read(8, self.timeout)
+      except self.usb.core.USBError:
+        return ''
+      if len(data) == 8 and data[0] == 0xA1 and data[1] == USB_NOTIFY_STATUS:
+        break
+    seq = data[3]
+    if self.status_seq is not None and seq != (self.status_seq + 1) & 0xFF:
+      raise IOError("Missed a status notification (got %d after %d)" % \
+        (seq, self.status_seq))
+    self.status_seq = seq
+    if data[5] != 0xFF:
+      self.committed_page = data[5]
+    return chr(data[2])
+
+  def vendor_request(self, request, value=0, index=0):
+    # Vendor control request to the device, bypassing the bulk pipe
+    self.dev.ctrl_transfer(0x40, request, value, index, None, self.timeout)
+
+  def vendor_status(self):
+    import struct
+    data = self.dev.ctrl_transfer(0xC0, VENDOR_REQ_STATUS, 0, 0, 5, self.timeout)
+    if len(data) < 5:
+      return None
+    records, result, page, pending = struct.unpack('<HBBB', data.tostring())
+    return {'records': records, 'result': chr(result),
+            'page': page if page != 0xFF else None, 'pending': pending}
+
+  def close(self):
+    if self.status_ep is not None:
+      # Leave the bootloader answering on the bulk pipe for the next user
+      self.status_ep = None
+      self.write(ihx_record(RECORD_STATUS_MODE, 0, [0]))
+      self.read()
+      self.usb.util.release_interface(self.dev, self.status_intf)
+    self.usb.util.release_interface(self.dev, self.intf)
+    for i in self.detached:
+      try:
+        self.dev.attach_kernel_driver(i)
+      except self.usb.core.USBError:
+        pass
+    self.usb.util.dispose_resources(self.dev)
+
+def tty_usb_address(port_name):
+  # Find the USB bus and device number behind a ttyACM device (Linux only)
+  import os
+  path = os.path.realpath("/sys/class/tty/%s/device" % os.path.basename(port_name))
+  # device points at the USB interface, its parent is the USB device
+  usb_dev = os.path.dirname(path)
+  bus = int(open(os.path.join(usb_dev, "busnum")).read())
+  address = int(open(os.path.join(usb_dev, "devnum")).read())
+  return (bus, address)
+
+def open_port(port_name, use_libusb=False, baud=SERIAL_BAUD):
+  # "usb" or "usb:SERIAL" always selects the libusb backend. A serial port name
+  # uses pySerial unless use_libusb is set, in which case the libusb backend
+  # is tried first on the same device, falling back to pySerial.
+  # Through libusb, record results come back on the interrupt endpoint if the
+  # bootloader can do that.
+  if port_name.startswith('replay:'):
+    return SimulatedDevice(port_name[7:])
+  if port_name == 'usb' or port_name.startswith('usb:'):
+    port = UsbTransport(port_name[4:] or None)
+    port.enable_status()
+    return port
+  if use_libusb:
+    try:
+      port = UsbTransport(bus_address=tty_usb_address(port_name))
+      port.enable_status()
+      return port
+    except Exception, e:
+      print "libusb backend unavailable (%s), using pySerial" % e
+  return serial.Serial(port_name, baud, timeout=1)
+
+def read_ack(serial_port):
+  # Result of the oldest record sent, wherever the port gets them from
+  if getattr(serial_port, 'status_ep', None) is not None:
+    return serial_port.read_ack()
+  return serial_port.read()
+
+def touch_port(port_name):
+  # Ask a running payload to reset into the bootloader. This only works if the
+  # payload left the bootloader's USB link up.
+  if port_name == 'usb' or port_name.startswith('usb:'):
+    import struct
+    import usb.core
+    import usb.util
+    for dev in usb.core.find(find_all=True, idVendor=USB_VID, idProduct=USB_PID):
+      if port_name[4:] and \
+         usb.util.get_string(dev, dev.iSerialNumber) != port_name[4:]:
+        continue
+      line_coding = struct.pack('<IBBB', BOOTLOADER_TOUCH_RATE, 0, 0, 8)
+      try:
+        # SET_LINE_CODING to the CDC control interface
+        dev.ctrl_transfer(0x21, 0x20, 0, 0, line_coding)
+      except usb.core.USBError:
+        # The device may go before it finishes the status stage
+        pass
+      return
+    raise IOError("No CC Bootloader USB device found")
+  try:
+    serial.Serial(port_name, BOOTLOADER_TOUCH_RATE).close()
+  except serial.SerialException:
+    pass
+
+def open_bootloader(port_name, use_libusb=False, baud=SERIAL_BAUD, timeout=10):
+  # Reset a running payload into the bootloader and reopen the port once the
+  # bootloader has enumerated
+  import time
+  touch_port(port_name)
+  # The device drops off the bus and resets about a second later
+  time.sleep(2)
+  deadline = time.time() + timeout
+  while True:
+    try:
+      return open_port(port_name, use_libusb, baud)
+    except Exception:
+      if time.time() > deadline:
+        raise
+      time.sleep(0.5)
+
+def pack_vendor_status(status):
+  import struct
+  if status is None:
+    return ''
+  page = status['page'] if status['page'] is not None else 0xFF
+  return struct.pack('<HcBB', status['records'], status['result'], page,
+                     status['pending'])
+
+def unpack_vendor_status(data):
+  import struct
+  if not data:
+    return None
+  records, result, page, pending = struct.unpack('<HcBB', data)
+  return {'records': records, 'result': result,
+          'page': page if page != 0xFF else None, 'pending': pending}
+
+class CapturePort:
+  # Passes everything through to port, recording each exchange with the
+  # device and how long it took in a capture file for replay
+  def __init__(self, port, filename):
+    import time
+    self.__dict__['port'] = port
+    self.__dict__['capture'] = open(filename, 'wb')
+    self.__dict__['start'] = time.time()
+    self.capture.write(CAPTURE_MAGIC)
+
+  def __getattr__(self, name):
+    attr = getattr(self.port, name)
+    if name in ('read_ack', 'vendor_request', 'vendor_status'):
+      return lambda *args: self._call(name, attr, args)
+    return attr
+
+  def __setattr__(self, name, value):
+    # e.g. status_seq and ccb_device_info belong to the port
+    setattr(self.port, name, value)
+
+  def _log(self, op, start, arg, data):
+    import struct, time
+    now = time.time()
+    self.capture.write(struct.pack(CAPTURE_HEADER, op,
+      int((start - self.start) * 1e6), int((now - start) * 1e6), arg,
+      len(data)) + data)
+
+  def _call(self, name, method, args):
+    import struct, time
+    start = time.time()
+    result = method(*args)
+    if name == 'read_ack':
+      self._log('A', start, 0, result)
+    elif name == 'vendor_request':
+      args = list(args) + [0, 0]
+      self._log('V', start, args[0], struct.pack('<HH', args[1], args[2]))
+    else:
+      self._log('S', start, 0, pack_vendor_status(result))
+    return result
+
+  def write(self, data):
+    import time
+    start = time.time()
+    result = self.port.write(data)
+    self._log('W', start, 0, data)
+    return result
+
+  def read(self, size=1):
+    import time
+    start = time.time()
+    data = self.port.read(size)
+    self._log('R', start, size, data)
+    return data
+
+  def readline(self):
+    import time
+    start = time.time()
+    line = self.port.readline()
+    self._log('L', start, 0, line)
+    return line
+
+  def __iter__(self):
+    while True:
+      line = self.readline()
+      if not line:
+        return
+      yield line
+
+  def close(self):
+    self.capture.close()
+    self.port.close()
+
+def read_capture(filename):
+  # List of (op, start s, duration s, argument, data) from a capture file
+  import struct
+  f = open(filename, 'rb')
+  if f.read(len(CAPTURE_MAGIC)) != CAPTURE_MAGIC:
+    raise IOError("%s isn't a capture file" % filename)
+  size = struct.calcsize(CAPTURE_HEADER)
+  events = []
+  while True:
+    header = f.read(size)
+    if len(header) < size:
+      break
+    op, start, took, arg, length = struct.unpack(CAPTURE_HEADER, header)
+    events.append((op, start / 1e6, took / 1e6, arg, f.read(length)))
+  f.close()
+  return events
+
+class SimulatedDevice:
+  # Stands in for the device a capture was taken from, answering with what it
+  # answered then and taking as long. Port name "replay:capture_file". The
+  # host has to send exactly what it sent then, IOError otherwise.
+  def __init__(self, filename):
+    self.events = read_capture(filename)
+    self.next = 0
+    ops = set(event[0] for event in self.events)
+    if 'A' in ops:
+      # Record results came on the interrupt endpoint
+      self.status_ep = True
+      self.status_seq = None
+    if 'V' in ops or 'S' in ops:
+      self.vendor_request = self._vendor_request
+      self.vendor_status = self._vendor_status
+
+  def _expect(self, op, arg=None, data=None):
+    # Next event, which must be the same exchange as the host is asking for
+    import time
+    if self.next >= len(self.events):
+      raise IOError("The host went past the end of the capture")
+    event = self.events[self.next]
+    if event[0] != op or (arg is not None and event[3] != arg) or \
+       (data is not None and event[4] != data):
+      raise IOError("The host left the capture at event %d (%.3f s): %s %r, "
+                    "expected %s %r" % (self.next, event[1], capture_ops[op],
+                    data, capture_ops[event[0]], event[4]))
+    self.next += 1
+    # Writes take time too once the device stops taking data
+    time.sleep(event[2])
+    return event[4]
+
+  def write(self, data):
+    self._expect('W', data=data)
+    return len(data)
+
+  def read(self, size=1):
+    return self._expect('R', arg=size)
+
+  def readline(self):
+    return self._expect('L')
+
+  def __iter__(self):
+    while True:
+      line = self.readline()
+      if not line:
+        return
+      yield line
+
+  def read_ack(self):
+    return self._expect('A')
+
+  def _vendor_request(self, request, value=0, index=0):
+    import struct
+    self._expect('V', request, struct.pack('<HH', value, index))
+
+  def _vendor_status(self):
+    return unpack_vendor_status(self._expect('S'))
+
+  def close(self):
+    pass
+
+def replay_capture(serial_port, filename, max_reports=20):
+  # Send what the host sent in a capture, keeping its pauses, and report
+  # where the device's answers or their timing differ from the capture
+  import struct, time
+  events = read_capture(filename)
+  if not events:
+    print "%s is empty" % filename
+    return True
+  print "Replaying %d events (%.3f s) from %s" % \
+    (len(events), events[-1][1] + events[-1][2], filename)
+  reports = 0
+  slower = 0
+  faster = 0
+  changed = 0
+  start = time.time()
+  last_end = None
+  last_end_now = start
+  for i, (op, at, took, arg, data) in enumerate(events):
+    # The host's own time between the last exchange and this one
+    if last_end is not None:
+      pause = last_end_now + (at - last_end) - time.time()
+      if pause > 0:
+        time.sleep(pause)
+    begin = time.time()
+    if op == 'W':
+      serial_port.write(data)
+      got = data
+    elif op == 'R':
+      got = serial_port.read(arg)
+    elif op == 'L':
+      got = serial_port.readline()
+    elif op == 'A':
+      got = read_ack(serial_port)
+    elif op == 'V':
+      value, index = struct.unpack('<HH', data)
+      serial_port.vendor_request(arg, value, index)
+      got = data
+    else:
+      # Counts in the status depend on what the device did before
+      got = pack_vendor_status(serial_port.vendor_status())
+      data = got
+    now = time.time()
+    last_end = at + took
+    last_end_now = now
+    
+    problem = None
+    if got != data:
+      changed += 1
+      # Show from just before the first difference
+      first = 0
+      while first < min(len(got), len(data)) and got[first] == data[first]:
+        first += 1
+      first = max(0, first - 8)
+      problem = "got %r, expected %r" % (got[first:first+32], data[first:first+32])
+    elif abs((now - begin) - took) > max(0.001, took / 2):
+      if now - begin > took:
+        slower += 1
+      else:
+        faster += 1
+      problem = "took %.2f ms, %.2f ms in the capture" % \
+        (1000 * (now - begin), 1000 * took)
+    if problem is not None:
+      reports += 1
+      if reports <= max_reports:
+        print "  event %d at %.3f s (%s): %s" % (i, at, capture_ops[op], problem)
+  elapsed = time.time() - start
+  if reports > max_reports:
+    print "  ... and %d more" % (reports - max_reports)
+  print "Replay took %.3f s, the capture %.3f s" % \
+    (elapsed, events[-1][1] + events[-1][2])
+  print "%d exchanges slower, %d faster, %d answered differently" % \
+    (slower, faster, changed)
+  return changed == 0
+
 bootloader_error_codes = {
   '0' : "OK",
   '1' : "Intel HEX Invalid",
@@ -11,33 +559,461 @@ bootloader_error_codes = {
   '5' : "Record Too Long"
 }
 
-def download_code(ihx_file, serial_port):
-  for line in ihx_file.readlines():
-    record_type = int(line[7:9], 16)
-    if (record_type == 0x00):
-      print "Writing", line[:-1],
-      serial_port.write(line)
-      rc = serial_port.read()
-      print " RC =", rc,
-      if rc in bootloader_error_codes:
-        print "(%s)" % bootloader_error_codes[rc]
+def ihx_record(record_type, address, data):
+  # Build an Intel HEX record, data is a list of byte values
+  record = [len(data), (address >> 8) & 0xFF, address & 0xFF, record_type] + data
+  chksum = (0x100 - (sum(record) & 0xFF)) & 0xFF
+  return ":" + "".join(["%02X" % b for b in record]) + "%02X\n" % chksum
+
+def erase_ahead(serial_port, first_page, last_page):
+  # Older bootloaders don't know this record, they just answer Bad Record Type
+  # and fall back to erasing each page as it is first written.
+  serial_port.write(ihx_record(RECORD_ERASE_AHEAD, 0, [first_page, last_page]))
+  rc = read_ack(serial_port)
+  print "Erase ahead pages %d-%d RC =" % (first_page, last_page), rc,
+  if rc in bootloader_error_codes:
+    print "(%s)" % bootloader_error_codes[rc]
+  else:
+    print "(Unknown Error)"
+  return rc == '0'
+
+IHX_MAX_LEN = 0x10
+PAGE_SIZE = 1024
+
+class FlashImage:
+  """
+  A flash image parsed from an Intel HEX file. data holds the bytes from
+  base upwards and ranges lists the (start, end) address ranges actually
+  present in the file, merged and sorted.
+  """
+  def __init__(self):
+    self.base = 0
+    self.data = bytearray()
+    self.ranges = []
+
+  def add(self, address, data):
+    if not self.data:
+      self.base = address
+    if address < self.base:
+      self.data[0:0] = bytearray('\xFF' * (self.base - address))
+      self.base = address
+    end = address + len(data) - self.base
+    if end > len(self.data):
+      self.data.extend('\xFF' * (end - len(self.data)))
+    self.data[address - self.base:end] = data
+    # Records almost always follow on from the previous one
+    if self.ranges and self.ranges[-1][1] == address:
+      self.ranges[-1] = (self.ranges[-1][0], address + len(data))
+    else:
+      self.ranges.append((address, address + len(data)))
+
+  def finish(self):
+    ranges = []
+    for start, end in sorted(self.ranges):
+      if ranges and start <= ranges[-1][1]:
+        ranges[-1] = (ranges[-1][0], max(end, ranges[-1][1]))
       else:
-        print "(Unknown Error)"
-      if (rc != '0'):
-        print "Error downloading code!"
+        ranges.append((start, end))
+    self.ranges = ranges
+
+  def size(self):
+    return sum([end - start for start, end in self.ranges])
+
+  def pages(self):
+    # First and last flash page touched by the image
+    if not self.ranges:
+      return (None, None)
+    return (self.ranges[0][0] / PAGE_SIZE, (self.ranges[-1][1] - 1) / PAGE_SIZE)
+
+  def page_list(self):
+    # Every flash page with some data in the image
+    pages = []
+    for start, end in self.ranges:
+      for page in range(start / PAGE_SIZE, (end - 1) / PAGE_SIZE + 1):
+        if page not in pages:
+          pages.append(page)
+    return pages
+
+  def records(self, max_len=IHX_MAX_LEN, record_type=0x00):
+    # Data records to send, aligned so they don't straddle max_len
+    # boundaries
+    for start, end in self.ranges:
+      address = start
+      while address < end:
+        length = min(max_len - (address % max_len), end - address)
+        chunk = self.data[address - self.base:address - self.base + length]
+        yield ihx_record(record_type, address, list(chunk))
+        address += length
+
+def parse_ihx(ihx_file):
+  # Parse an Intel HEX file line by line into a FlashImage
+  image = FlashImage()
+  for n, line in enumerate(ihx_file):
+    line = line.strip()
+    if not line:
+      continue
+    if line[0] != ':':
+      raise ValueError("line %d: not an Intel HEX record" % (n+1))
+    record = bytearray.fromhex(line[1:])
+    if (sum(record) & 0xFF) != 0 or len(record) != record[0] + 5:
+      raise ValueError("line %d: bad record" % (n+1))
+    address = (record[1] << 8) | record[2]
+    record_type = record[3]
+    if record_type == 0x00:
+      image.add(address, record[4:-1])
+    elif record_type == 0x01:
+      break
+    elif record_type in (0x02, 0x04) and any(record[4:-1]):
+      raise ValueError("line %d: address beyond 64k" % (n+1))
+  image.finish()
+  return image
+
+# Bump when the cache format or what FlashImage holds changes, older cache
+# files are then parsed again rather than read
+IMAGE_CACHE_VERSION = 1
+
+def image_cache_dir():
+  import os
+  return os.path.join(os.path.expanduser("~"), ".cache", "ccbootloader")
+
+def read_image_cache(cache_name, digest):
+  # The cached image as plain JSON data, None unless it is for this version
+  # of the format and this hex file and holds together
+  import json
+  try:
+    cache = json.load(open(cache_name, 'r'))
+    if cache['version'] != IMAGE_CACHE_VERSION or cache['source'] != digest:
+      return None
+    image = FlashImage()
+    image.base = int(cache['base'])
+    image.data = bytearray.fromhex(str(cache['data']))
+    image.ranges = [(int(start), int(end)) for start, end in cache['ranges']]
+  except (IOError, ValueError, KeyError, TypeError):
+    return None
+  for start, end in image.ranges:
+    if start < image.base or start >= end or end - image.base > len(image.data):
+      return None
+  return image
+
+def write_image_cache(cache_name, digest, image):
+  import json
+  cache = {
+    'version': IMAGE_CACHE_VERSION,
+    'source': digest,
+    'base': image.base,
+    'data': str(image.data).encode('hex'),
+    'ranges': image.ranges,
+  }
+  json.dump(cache, open(cache_name, 'w'))
+
+def load_image(ihx_filename):
+  # Parsed images are cached by the hash of the hex file, so repeated
+  # downloads of the same file skip the parse.
+  import os, hashlib
+  digest = hashlib.sha1(open(ihx_filename, 'rb').read()).hexdigest()
+  cache_name = os.path.join(image_cache_dir(), digest + ".json")
+  image = read_image_cache(cache_name, digest)
+  if image is not None:
+    return image
+  image = parse_ihx(open(ihx_filename, 'r'))
+  try:
+    if not os.path.isdir(image_cache_dir()):
+      os.makedirs(image_cache_dir())
+    write_image_cache(cache_name, digest, image)
+  except (IOError, OSError):
+    pass
+  return image
+
+class Progress:
+  # Progress bar that redraws at most every interval seconds
+  def __init__(self, total, interval=0.1):
+    import sys, time
+    self.time = time.time
+    self.out = sys.stdout
+    self.total = max(total, 1)
+    self.interval = interval
+    self.last = 0
+
+  def update(self, done, force=False):
+    now = self.time()
+    if not force and now - self.last < self.interval:
+      return
+    self.last = now
+    bar = 40 * done / self.total
+    self.out.write("\r[%s%s] %3d%% %d/%d bytes" %
+      ('#' * bar, ' ' * (40 - bar), 100 * done / self.total, done, self.total))
+    self.out.flush()
+
+  def finish(self):
+    self.update(self.total, True)
+    self.out.write("\n")
+
+PAGE_UNTOUCHED = 0
+PAGE_ERASED = 1
+PAGE_PARTIAL = 2
+PAGE_COMPLETE = 3
+
+def page_states(serial_port):
+  # Ask the bootloader how far it got with each flash page, returns None if
+  # it is too old to answer
+  serial_port.write(ihx_record(RECORD_PAGE_STATE, 0, []))
+  states = serial_port.readline().strip()
+  if len(states) < 2 or [c for c in states if c not in '0123']:
+    return None
+  return [int(c) for c in states]
+
+device_features = {
+  0x01 : "timer",
+  0x02 : "journal",
+  0x04 : "vendor_bulk",
+  0x08 : "warm_handoff",
+  0x10 : "vendor_requests",
+  0x20 : "uart_link",
+  0x40 : "trace"
+}
+
+def device_info(serial_port):
+  # Ask the bootloader what it supports, returns None if it is too old to
+  # answer. The answer is remembered on the port object.
+  if hasattr(serial_port, 'ccb_device_info'):
+    return serial_port.ccb_device_info
+  serial_port.write(ihx_record(RECORD_DEVICE_INFO, 0, []))
+  fields = serial_port.readline().split()
+  info = None
+  if len(fields) == 8:
+    fields = [int(f, 16) for f in fields]
+    info = {
+      'version':   fields[0],
+      'flash_size': fields[1],
+      'page_size': fields[2],
+      'user_base': fields[3],
+      'user_end':  fields[4],
+      'max_len':   fields[5],
+      'records':   fields[6],
+      'features':  [name for bit, name in sorted(device_features.items())
+                    if fields[7] & bit]
+    }
+  serial_port.ccb_device_info = info
+  return info
+
+def supports(info, record_type):
+  return info is not None and bool(info['records'] & (1 << (record_type - 0x22)))
+
+def vendor_requests(serial_port):
+  # Vendor control requests need libusb and a bootloader that knows them
+  if not hasattr(serial_port, 'vendor_request'):
+    return False
+  info = device_info(serial_port)
+  return info is not None and 'vendor_requests' in info['features']
+
+def wait_vendor_request(serial_port, timeout=30):
+  # Poll until the main loop has carried out the last vendor request
+  import time
+  deadline = time.time() + timeout
+  while time.time() < deadline:
+    status = serial_port.vendor_status()
+    if status is not None and not status['pending']:
+      return status
+    time.sleep(0.01)
+  return None
+
+def abort_transfer(serial_port):
+  # Have the device drop whatever is still queued for it, then throw away
+  # anything it sent back
+  serial_port.vendor_request(VENDOR_REQ_ABORT)
+  ok = wait_vendor_request(serial_port) is not None
+  while serial_port.read(64):
+    pass
+  if getattr(serial_port, 'status_ep', None) is not None:
+    while serial_port.read_ack():
+      pass
+    serial_port.status_seq = None
+  return ok
+
+def print_vendor_status(serial_port):
+  if not vendor_requests(serial_port):
+    print "Status needs libusb and a bootloader that supports vendor requests"
+    return False
+  status = serial_port.vendor_status()
+  if status is None:
+    print "No status from the device!"
+    return False
+  print "Records answered:   %d" % status['records']
+  print "Last result:        %s (%s)" % (status['result'],
+    bootloader_error_codes.get(status['result'], "Unknown Error"))
+  if status['page'] is not None:
+    print "Last page complete: %d" % status['page']
+  print "Request pending:    %s" % (status['pending'] and "yes" or "no")
+  return True
+
+def print_device_info(serial_port):
+  info = device_info(serial_port)
+  if info is None:
+    print "Bootloader doesn't support the device info record"
+    return False
+  print "Bootloader version: %x.%02x" % (info['version'] >> 8, info['version'] & 0xFF)
+  print "Flash size:         0x%04X" % info['flash_size']
+  print "Page size:          %d" % info['page_size']
+  print "User code:          0x%04X-0x%04X" % (info['user_base'], info['user_end'] - 1)
+  print "Max record length:  %d" % info['max_len']
+  print "Record types:       %s" % " ".join(["0x%02X" % (0x22 + n)
+    for n in range(16) if info['records'] & (1 << n)])
+  print "Features:           %s" % (" ".join(info['features']) or "none")
+  return True
+
+def download_code(image, serial_port, window=1, verbose=False, resume=False):
+  # Up to window records are sent before waiting for the first one's
+  # result, USB flow control holds back the host if the device falls behind.
+  info = device_info(serial_port)
+  max_len = IHX_MAX_LEN
+  if info is not None:
+    max_len = info['max_len']
+    for start, end in image.ranges:
+      if start < info['user_base'] or end > info['user_end']:
+        print "Image doesn't fit in user flash (0x%04X-0x%04X)!" % \
+          (info['user_base'], info['user_end'] - 1)
         return False
+    
+  skip_pages = []
+  if resume and info is not None and not supports(info, RECORD_PAGE_STATE):
+    print "Bootloader can't report page states, downloading everything"
+  elif resume:
+    states = page_states(serial_port)
+    if states is None:
+      print "Bootloader can't report page states, downloading everything"
+    else:
+      # Pages left half written are erased and written again from scratch
+      for page in image.page_list():
+        if states[page] == PAGE_COMPLETE:
+          skip_pages.append(page)
+        elif states[page] == PAGE_PARTIAL:
+          if not erase_user_page(serial_port, page):
+            return False
+      print "Resuming, %d of %d pages already complete" % \
+        (len(skip_pages), len(image.page_list()))
+  records = [line for line in image.records(max_len)
+             if int(line[3:7], 16) / PAGE_SIZE not in skip_pages]
+  if not records:
+    return True
+  progress = Progress(sum([int(line[1:3], 16) for line in records]))
+  if info is None or supports(info, RECORD_ERASE_AHEAD):
+    # Declare each run of pages the image writes as the writes reach it, so
+    # pages in the gaps between runs are never erased. The bootloader only
+    # erases ahead within one run at a time.
+    runs = page_runs([page for page in image.page_list() if page not in skip_pages])
+    if erase_ahead(serial_port, runs[0][0], runs[0][1]):
+      records = with_erase_ahead(records, runs[1:])
+  try:
+    return send_records(serial_port, records, progress, window, verbose)
+  except KeyboardInterrupt:
+    print
+    if vendor_requests(serial_port):
+      # Records queued on the bulk pipe would otherwise still be written
+      print "Aborting the download"
+      abort_transfer(serial_port)
+    raise
+
+def page_runs(pages):
+  # Runs of consecutive pages as (first, last), pages in ascending order
+  runs = []
+  for page in pages:
+    if runs and runs[-1][1] == page - 1:
+      runs[-1] = (runs[-1][0], page)
     else:
-      print "Skipping non data record: '%s'" % line[:-1]
+      runs.append((page, page))
+  return runs
+
+def with_erase_ahead(records, runs):
+  # Put an erase ahead record for each run in front of its first record
+  for line in records:
+    page = int(line[3:7], 16) / PAGE_SIZE
+    while runs and page >= runs[0][0]:
+      yield ihx_record(RECORD_ERASE_AHEAD, 0, [runs[0][0], runs[0][1]])
+      runs = runs[1:]
+    yield line
+
+def send_records(serial_port, records, progress, window, verbose):
+  done = 0
+  pending = []
+  records = iter(records)
+  while True:
+    line = next(records, None)
+    if line is not None:
+      serial_port.write(line)
+      pending.append(line)
+      if len(pending) < window:
+        continue
+    if not pending:
+      break
+    rc = read_ack(serial_port)
+    line = pending.pop(0)
+    if verbose:
+      print "Writing", line[:-1], " RC =", rc,
+      print "(%s)" % bootloader_error_codes.get(rc, "Unknown Error")
+    if (rc != '0'):
+      if not verbose:
+        print
+        print "Writing", line[:-1], " RC =", rc,
+        print "(%s)" % bootloader_error_codes.get(rc, "Unknown Error")
+      print "Error downloading code!"
+      return False
+    if line[7:9] == "00":
+      done += int(line[1:3], 16)
+    if not verbose:
+      progress.update(done)
+  if not verbose:
+    progress.finish()
   return True
 
+def ram_run(image, serial_port, window=1):
+  # Load a test payload into RAM and run it, leaving flash alone
+  info = device_info(serial_port)
+  if info is not None and not supports(info, RECORD_RAM_RUN):
+    print "Bootloader can't run code from RAM!"
+    return False
+  for start, end in image.ranges:
+    if start < RAM_CODE_BASE or end > RAM_CODE_END:
+      print "Image doesn't fit in RAM (0x%04X-0x%04X)!" % \
+        (RAM_CODE_BASE, RAM_CODE_END - 1)
+      return False
+  pending = 0
+  for line in image.records(IHX_MAX_LEN, RECORD_RAM_DATA):
+    serial_port.write(line)
+    pending += 1
+    if pending < window:
+      continue
+    rc = read_ack(serial_port)
+    pending -= 1
+    if (rc != '0'):
+      print "Error loading code into RAM, RC =", rc,
+      print "(%s)" % bootloader_error_codes.get(rc, "Unknown Error")
+      return False
+  while pending:
+    rc = read_ack(serial_port)
+    pending -= 1
+    if (rc != '0'):
+      print "Error loading code into RAM, RC =", rc,
+      print "(%s)" % bootloader_error_codes.get(rc, "Unknown Error")
+      return False
+  entry = image.ranges[0][0]
+  serial_port.write(ihx_record(RECORD_RAM_RUN, entry, []))
+  rc = read_ack(serial_port)
+  print "Running from RAM at 0x%04X RC =" % entry, rc,
+  print "(%s)" % bootloader_error_codes.get(rc, "Unknown Error")
+  return rc == '0'
+
 def run_user_code(serial_port):
-  # User code is entered on intel HEX EOF record
-  serial_port.write(":00000001FF\n")
+  # User code is entered on intel HEX EOF record, or straight away with a
+  # vendor request
+  if vendor_requests(serial_port):
+    serial_port.vendor_request(VENDOR_REQ_RUN)
+  else:
+    serial_port.write(":00000001FF\n")
   return True
   
 def reset_bootloader(serial_port):
   serial_port.write(":00000022DE\n")
-  rc = serial_port.read()
+  rc = read_ack(serial_port)
   print "RC =", rc,
   if rc in bootloader_error_codes:
     print "(%s)" % bootloader_error_codes[rc]
@@ -50,7 +1026,7 @@ def reset_bootloader(serial_port):
 
 def erase_all_user(serial_port):
   serial_port.write(":00000023DD\n")
-  rc = serial_port.read()
+  rc = read_ack(serial_port)
   print "RC =", rc,
   if rc in bootloader_error_codes:
     print "(%s)" % bootloader_error_codes[rc]
@@ -64,7 +1040,7 @@ def erase_all_user(serial_port):
 def erase_user_page(serial_port, page):
   chksum = (0xDB + 0x100 - page) & 0xFF
   serial_port.write(":01000024%02X%02X\n" % (page, chksum))
-  rc = serial_port.read()
+  rc = read_ack(serial_port)
   print "RC =", rc,
   if rc in bootloader_error_codes:
     print "(%s)" % bootloader_error_codes[rc]
@@ -75,6 +1051,128 @@ def erase_user_page(serial_port, page):
     return False
   return True
 
+def erase_range(serial_port, first_page, last_page):
+  info = device_info(serial_port)
+  rc = '4'
+  if vendor_requests(serial_port):
+    # Out of band, doesn't wait behind anything still on the bulk pipe
+    serial_port.vendor_request(VENDOR_REQ_ERASE_RANGE, first_page, last_page)
+    if wait_vendor_request(serial_port) is None:
+      print "Timed out waiting for the erase!"
+      return False
+    rc = '0'
+  elif info is None or supports(info, RECORD_ERASE_RANGE):
+    serial_port.write(ihx_record(RECORD_ERASE_RANGE, 0, [first_page, last_page]))
+    rc = read_ack(serial_port)
+  if rc == '4':
+    # Bootloader predates the range erase record, erase page by page
+    print "Range erase not supported, erasing one page at a time"
+    for page in range(first_page, last_page+1):
+      if not erase_user_page(serial_port, page):
+        return False
+    return True
+  print "RC =", rc,
+  if rc in bootloader_error_codes:
+    print "(%s)" % bootloader_error_codes[rc]
+  else:
+    print "(Unknown Error)"
+  if (rc != '0'):
+    print "Error erasing user flash pages!"
+    return False
+  return True
+
+def print_stats(serial_port, clear=False):
+  # Show the bootloader's performance counters, see IHX_RECORD_STATS
+  info = device_info(serial_port)
+  if info is not None and not supports(info, RECORD_STATS):
+    print "Bootloader doesn't keep performance counters!"
+    return False
+  serial_port.write(ihx_record(RECORD_STATS, 0, [clear and 1 or 0]))
+  fields = serial_port.readline().split()
+  if len(fields) != 13:
+    print "Bad reply from the device!"
+    return False
+  fields = [int(f, 16) for f in fields]
+  records, errors, counts, ticks = fields[0], fields[1:6], fields[6:10], fields[10:]
+  ms = lambda t: "%.1f ms" % (1000 * t / STATS_TICK_HZ)
+  print "Records:            %d" % records
+  for rc, count in zip('12345', errors):
+    if count:
+      print "  %-18s %d" % (bootloader_error_codes[rc] + ":", count)
+  print "Pages erased:       %d" % counts[0]
+  print "Flash writes:       %d" % counts[1]
+  print "USB packets out/in: %d/%d" % (counts[2], counts[3])
+  print "Waiting for flash:  %s" % ms(ticks[0])
+  print "Waiting for host:   %s" % ms(ticks[1])
+  print "Since cleared:      %s" % ms(ticks[2])
+  return True
+
+def read_trace(serial_port, clear=False):
+  # Fetch the event trace as a list of (event, arg, time in us). Timestamps
+  # wrap every 350 ms, longer gaps between events can't be told apart.
+  serial_port.write(ihx_record(RECORD_TRACE, 0, [clear and 1 or 0]))
+  entries = []
+  while True:
+    line = serial_port.readline()
+    if not line or line == "\n":
+      break
+    line = line.strip()
+    for i in range(0, len(line) - 7, 8):
+      entries.append((int(line[i:i+2], 16), int(line[i+2:i+4], 16),
+                      int(line[i+4:i+8], 16)))
+  trace = []
+  last = None
+  now = 0
+  for event, arg, count in entries:
+    if last is not None:
+      now += (count - last) & 0xFFFF
+    last = count
+    trace.append((event, arg, now * TRACE_TICK_US))
+  return trace
+
+def print_trace(serial_port, clear=False):
+  # Show the event trace as a timeline
+  info = device_info(serial_port)
+  if info is not None and 'trace' not in info['features']:
+    print "Bootloader wasn't built with TRACE!"
+    return False
+  trace = read_trace(serial_port, clear)
+  if not trace:
+    print "Trace is empty"
+    return True
+  started = {}
+  last = 0
+  print "     time us    delta us  event"
+  for event, arg, t in trace:
+    name, fmt = trace_events.get(event, ("event %02X" % event, "arg %02X"))
+    text = name
+    if fmt is not None:
+      text += " " + fmt % (chr(arg + ord('0')) if '%c' in fmt else arg)
+    # Show how long erases and writes took
+    if event in (0x05, 0x07):
+      started[event] = t
+    elif event in (0x06, 0x08) and event - 1 in started:
+      text += " (%.1f us)" % (t - started.pop(event - 1))
+    print "%12.1f %11.1f  %s" % (t, t - last, text)
+    last = t
+  return True
+
+def set_serial(serial_port, serial_number):
+  # Provision the board's USB serial number, this can only be done once
+  if not 1 <= len(serial_number) <= 16:
+    print "Serial number must be 1 to 16 characters!"
+    return False
+  serial_port.write(ihx_record(RECORD_SET_SERIAL, 0, map(ord, serial_number)))
+  rc = read_ack(serial_port)
+  print "RC =", rc,
+  print "(%s)" % bootloader_error_codes.get(rc, "Unknown Error")
+  if rc == '3':
+    print "A serial number has already been set!"
+  if (rc != '0'):
+    return False
+  print "Serial number set, it is used the next time the device enumerates"
+  return True
+
 def flash_read(serial_port, start_addr, length):
   chksum = (0xD9 + 
             (0x100 - (start_addr & 0xFF)) +
@@ -88,20 +1186,188 @@ def flash_read(serial_port, start_addr, length):
     if (line == ":00000001FF\n"):
       break
 
+def benchmark(serial_port, count, window=1):
+  # Time round trips of a zero length read, which has no side effects on the
+  # device, to measure host and link latency separately from flash time.
+  import time
+  record = ihx_record(0x25, 0, [0, 0])
+  start = time.time()
+  sent = 0
+  done = 0
+  while done < count:
+    # Keep up to window requests in flight
+    while sent < count and sent - done < window:
+      serial_port.write(record)
+      sent += 1
+    line = serial_port.readline()
+    if not line:
+      print "Timed out waiting for the device!"
+      break
+    if line == ":00000001FF\n":
+      done += 1
+  elapsed = time.time() - start
+  print "%d round trips in %.3f s, %.3f ms each (window %d)" % \
+    (done, elapsed, 1000.0 * elapsed / max(done, 1), window)
+
+def linktest_start(serial_port, mode, length):
+  length_bytes = [(length >> shift) & 0xFF for shift in (24, 16, 8, 0)]
+  serial_port.write(ihx_record(RECORD_LINKTEST, 0, [mode] + length_bytes))
+  return read_ack(serial_port) == '0'
+
+def linktest_report(serial_port, length):
+  # Packets out and in and seconds taken, as counted by the device, or None
+  # if the test didn't complete
+  fields = serial_port.readline().split()
+  if len(fields) != 4:
+    print "Timed out waiting for the device!"
+    return None
+  out_packets, in_packets, ticks, moved = [int(f, 16) for f in fields]
+  if moved < length:
+    print "The device gave up after %d of %d bytes" % (moved, length)
+    return None
+  return out_packets, in_packets, ticks / STATS_TICK_HZ
+
+def link_test(serial_port, length=65536, echo_count=200):
+  # Measure the raw USB link with the device just sinking, sourcing or echoing
+  # bulk data, to show the ceiling for anything done to the protocol
+  import time
+  info = device_info(serial_port)
+  if info is not None and not supports(info, RECORD_LINKTEST):
+    print "Bootloader doesn't have a link test!"
+    return False
+  rate = lambda n, t: "%.1f kB/s" % (n / max(t, 1e-6) / 1000)
+  
+  # Host to device
+  if not linktest_start(serial_port, LINKTEST_SINK, length):
+    print "Link test refused (it only runs over USB)"
+    return False
+  block = '\x55' * 4096
+  start = time.time()
+  for i in range(0, length, len(block)):
+    serial_port.write(block[:length - i])
+  report = linktest_report(serial_port, length)
+  elapsed = time.time() - start
+  if report is None:
+    return False
+  print "Host to device:  %d bytes in %.3f s, %s (device %s, %d packets)" % \
+    (length, elapsed, rate(length, elapsed), rate(length, report[2]), report[0])
+  
+  # Device to host, each packet carries 00 01 02 ..
+  if not linktest_start(serial_port, LINKTEST_SOURCE, length):
+    print "Link test refused"
+    return False
+  start = time.time()
+  data = ''
+  while len(data) < length:
+    chunk = serial_port.read(min(4096, length - len(data)))
+    if not chunk:
+      break
+    data += chunk
+  elapsed = time.time() - start
+  report = linktest_report(serial_port, length)
+  if report is None:
+    return False
+  if len(data) < length:
+    print "Timed out waiting for the device!"
+    return False
+  pattern = ''.join(chr(i) for i in range(LINKTEST_PACKET))
+  expected = (pattern * (length / LINKTEST_PACKET + 1))[:length]
+  print "Device to host:  %d bytes in %.3f s, %s (device %s, %d packets)%s" % \
+    (length, elapsed, rate(length, elapsed), rate(length, report[2]),
+     report[1], "" if data == expected else ", DATA CORRUPTED")
+  
+  # Round trips of one packet each
+  if not linktest_start(serial_port, LINKTEST_ECHO, echo_count * LINKTEST_PACKET):
+    print "Link test refused"
+    return False
+  times = []
+  corrupted = False
+  for i in range(echo_count):
+    packet = ''.join(chr((i + j) & 0xFF) for j in range(LINKTEST_PACKET))
+    start = time.time()
+    serial_port.write(packet)
+    reply = serial_port.read(LINKTEST_PACKET)
+    times.append(time.time() - start)
+    if len(reply) < LINKTEST_PACKET:
+      print "Timed out waiting for the device!"
+      return False
+    corrupted = corrupted or reply != packet
+  report = linktest_report(serial_port, echo_count * LINKTEST_PACKET)
+  if report is None:
+    return False
+  print "Echo round trip: %d packets, min %.3f ms, avg %.3f ms, max %.3f ms%s" % \
+    (echo_count, 1000 * min(times), 1000 * sum(times) / len(times),
+     1000 * max(times), ", DATA CORRUPTED" if corrupted else "")
+  return True
+
 def print_usage():
   import sys
   print """
 CC Bootloader Download Utility
 
-Usage:  ./bootload.py serial_port command
+Usage:  ./bootload.py [options] serial_port command [+ command ...]
+        ./bootload.py [options] daemon socket_path
+
+Several commands separated by '+' are run one after the other over the same
+connection, stopping at the first one that fails, e.g.
+
+  ./bootload.py /dev/ttyACM0 erase_all + download code.hex + run
+
+"daemon" starts a server on the Unix socket socket_path that keeps serial
+ports open between jobs. Jobs are sent to it with the --daemon option.
+
+serial_port can also be "usb" (or "usb:SERIAL" to pick a device by its USB
+serial number) to talk to the bootloader's bulk endpoints through libusb
+instead of the CDC serial port. This needs pyusb.
+
+Options:
+  --libusb
+    Talk to the device behind serial_port through libusb, bypassing the
+    kernel's tty layer. Falls back to pySerial if that isn't possible.
+
+  --daemon=socket_path
+    Send the commands to a daemon listening on socket_path rather than
+    opening serial_port directly.
+
+  --enter
+    The device is running a payload which left the USB link up. Reset it
+    into the bootloader first (by setting the port to 1200 baud) and wait
+    for it to come back.
+
+  --resume
+    Carry on with a download that was interrupted, skipping pages the
+    bootloader reports as complete and rewriting any it only got part way
+    through. The device must not have been reset in between, unless the
+    bootloader was built with JOURNAL.
+
+  --verbose
+    Print every record sent during download instead of a progress bar.
+
+  --window=n
+    Keep up to n records in flight during download and bench rather than
+    waiting for each one to be acknowledged before sending the next.
+    Over a UART link keep n to 2 or less, the bootloader can't hold more.
+
+  --baud=n
+    Baud rate for a bootloader on a UART link (default 1000000).
+
+  --capture=file
+    Record everything sent to and received from the device, with timings, in
+    file for the replay command. Not with --daemon.
 
 Commands:
   download hex_file
-    Download hex_file to the device.
+    Download hex_file to the device. Parsed hex files are cached in
+    ~/.cache/ccbootloader so downloading the same file again is quicker.
     
   run
     Run the user code.
     
+  ram_run hex_file
+    Load hex_file into RAM and run it without touching flash. The code must
+    be linked to run from RAM between 0xF400 and 0xFDFF, e.g. with
+    --code-loc 0xf400 --code-size 0xa00 --xram-loc 0xf000 --xram-size 0x400
+    
   reset
     The bootloader will not erase pages that have previously been written to
     before writing new data to that page. This allows for random access writes
@@ -120,57 +1386,316 @@ Commands:
     determine which page the user code starts on please check the
     USER_CODE_BASE setting in main.h.
     
+  erase_range first last
+    Erases pages first to last inclusive, skipping pages that are already
+    blank.
+    
   read start_addr len
     Reads len bytes from flash memory starting from start_addr. start_addr and
     len should be specified in hexadecimal (e.g. 0x1234).
+
+  info
+    Shows the bootloader version, flash layout and supported features.
+
+  set_serial serial_number
+    Gives the board its own USB serial number (up to 16 characters). This
+    can only be done once.
+
+  trace [clear]
+    Shows the bootloader's event trace as a timeline, for bootloaders built
+    with TRACE. "clear" empties it afterwards.
+
+  stats [clear]
+    Shows the bootloader's performance counters: records handled and
+    rejected, flash erases and writes, USB packets and the time spent waiting
+    for the flash and for the host. "clear" starts them again from zero.
+
+  status
+    Shows how far the bootloader has got, asked for with a USB control
+    request that doesn't queue behind data on the serial pipe (libusb only).
+
+  abort
+    Makes the bootloader drop any data still queued for it (libusb only).
+    Interrupting a download with Ctrl-C does the same.
+
+  replay capture_file
+    Sends the device what was sent in a capture taken with --capture, with
+    the same pauses, and reports where the answers or their timing differ.
+    serial_port can be "replay:capture_file" to stand in for the device the
+    capture was taken from, answering as it did and just as quickly, e.g. to
+    run a newer bootload.py against a customer's capture.
+
+  linktest [n]
+    Measures the raw USB link, with the bootloader only sinking, sourcing or
+    echoing n bytes (default 65536) of bulk data, without record handling or
+    flash in the way. Shows throughput both ways and packet round trip times.
+
+  bench [n]
+    Times n (default 1000) round trips to the bootloader that don't touch
+    flash, to measure host and USB latency on its own.
   """
 
-if __name__ == '__main__':
-  import sys
-  if (len(sys.argv) < 3):
-    print_usage()
-    sys.exit(1)
+def run_command(serial_port, command, options, settings):
+  # Run a single command, returns False if it failed
+  if (command == 'download'):
+    if (len(options) < 1):
+      print_usage()
+      return False
+    image = load_image(options[0])
+    return download_code(image, serial_port, settings['window'],
+                         settings['verbose'], settings.get('resume', False))
     
-  serial_port_name = sys.argv[1]
-  command = sys.argv[2]
-  options = sys.argv[3:]
-  serial_port = serial.Serial(serial_port_name, timeout=1)
-  
-  try:
-    if (command == 'download'):
-      if (len(options) < 1):
-        print_usage()
-      else:
-        ihx_filename = options[0]
-        ihx_file = open(ihx_filename, 'r')
-        download_code(ihx_file, serial_port)
-        
-    elif (command == 'run'):
-      run_user_code(serial_port)
+  elif (command == 'run'):
+    return run_user_code(serial_port)
+    
+  elif (command == 'ram_run'):
+    if (len(options) < 1):
+      print_usage()
+      return False
+    return ram_run(load_image(options[0]), serial_port, settings['window'])
+    
+  elif (command == 'reset'):
+    return reset_bootloader(serial_port)
+    
+  elif (command == 'erase_all'):
+    return erase_all_user(serial_port)
+    
+  elif (command == 'erase'):
+    if (len(options) < 1):
+      print_usage()
+      return False
+    return erase_user_page(serial_port, int(options[0]))
       
-    elif (command == 'reset'):
-      reset_bootloader(serial_port)
+  elif (command == 'erase_range'):
+    if (len(options) < 2):
+      print_usage()
+      return False
+    return erase_range(serial_port, int(options[0]), int(options[1]))
       
-    elif (command == 'erase_all'):
-      erase_all_user(serial_port)
+  elif (command == 'read'):
+    if (len(options) < 2):
+      print_usage()
+      return False
+    flash_read(serial_port, int(options[0], 16), int(options[1], 16))
+    return True
       
-    elif (command == 'erase'):
-      if (len(options) < 1):
-        print_usage()
-      else:
-        erase_user_page(serial_port, int(options[0]))
-        
-    elif (command == 'read'):
-      if (len(options) < 2):
-        print_usage()
-      else:
-        flash_read(serial_port, int(options[0], 16), int(options[1], 16))
-        
-        
-    else:
+  elif (command == 'info'):
+    return print_device_info(serial_port)
+    
+  elif (command == 'set_serial'):
+    if (len(options) < 1):
       print_usage()
-  finally:
-    serial_port.close()
+      return False
+    return set_serial(serial_port, options[0])
+    
+  elif (command == 'status'):
+    return print_vendor_status(serial_port)
+    
+  elif (command == 'trace'):
+    return print_trace(serial_port, options[:1] == ['clear'])
+    
+  elif (command == 'stats'):
+    return print_stats(serial_port, options[:1] == ['clear'])
+    
+  elif (command == 'abort'):
+    if not vendor_requests(serial_port):
+      print "Abort needs libusb and a bootloader that supports vendor requests"
+      return False
+    return abort_transfer(serial_port)
+      
+  elif (command == 'replay'):
+    if (len(options) < 1):
+      print_usage()
+      return False
+    return replay_capture(serial_port, options[0])
+    
+  elif (command == 'linktest'):
+    if (len(options) < 1):
+      return link_test(serial_port)
+    return link_test(serial_port, int(options[0]))
+      
+  elif (command == 'bench'):
+    if (len(options) < 1):
+      benchmark(serial_port, 1000, settings['window'])
+    else:
+      benchmark(serial_port, int(options[0]), settings['window'])
+    return True
+      
+  print_usage()
+  return False
+
+def run_script(serial_port, script, settings):
+  # Run a list of [command, options...] steps, stopping at the first failure
+  for step in script:
+    if not run_command(serial_port, step[0], step[1:], settings):
+      return False
+  return True
+
+def split_script(args):
+  # Commands on the command line are separated by '+'
+  script = [[]]
+  for arg in args:
+    if arg == '+':
+      script.append([])
+    else:
+      script[-1].append(arg)
+  return [step for step in script if step]
+
+class ThreadOutput:
+  # Stands in for sys.stdout so each daemon job's output goes to its client
+  def __init__(self, default):
+    import threading
+    self.default = default
+    self.local = threading.local()
+
+  def write(self, data):
+    getattr(self.local, 'out', self.default).write(data)
+
+  def flush(self):
+    getattr(self.local, 'out', self.default).flush()
 
+def run_daemon(socket_path, use_libusb):
+  """
+  Keep serial ports open between jobs. Each client connection sends one job
+  as a line of JSON: {"port": ..., "script": [[command, options...], ...],
+  "window": n, "verbose": bool, "enter": bool}. The job's output is streamed back, followed
+  by a final "RESULT OK" or "RESULT FAILED" line.
+  """
+  import os, sys, json, threading, SocketServer
+
+  ports = {}
+  ports_lock = threading.Lock()
+  output = ThreadOutput(sys.stdout)
+  sys.stdout = output
+
+  def get_port(name):
+    # One open port and one lock per device, jobs on a device run in turn
+    with ports_lock:
+      if name not in ports:
+        ports[name] = [None, threading.Lock()]
+      return ports[name]
 
+  class JobHandler(SocketServer.StreamRequestHandler):
+    def handle(self):
+      output.local.out = self.wfile
+      ok = False
+      try:
+        job = json.loads(self.rfile.readline())
+        settings = {'window': job.get('window', 1),
+                    'verbose': job.get('verbose', False),
+                    'resume': job.get('resume', False)}
+        port = get_port(job['port'])
+        with port[1]:
+          try:
+            if job.get('enter'):
+              # The payload's port goes away when it resets
+              if port[0] is not None:
+                port[0].close()
+                port[0] = None
+              port[0] = open_bootloader(job['port'], use_libusb,
+                                        job.get('baud', SERIAL_BAUD))
+            elif port[0] is None:
+              port[0] = open_port(job['port'], use_libusb,
+                                  job.get('baud', SERIAL_BAUD))
+            ok = run_script(port[0], job['script'], settings)
+          finally:
+            # The device drops off the bus once user code runs, and after
+            # an error we don't know what state the port is in, so reopen.
+            ran = [step for step in job['script'] if step[0] in ('run', 'ram_run')]
+            if port[0] is not None and (ran or not ok):
+              port[0].close()
+              port[0] = None
+      except Exception, e:
+        print "Error:", e
+      print "RESULT", ok and "OK" or "FAILED"
+      del output.local.out
+
+  class Server(SocketServer.ThreadingMixIn, SocketServer.UnixStreamServer):
+    daemon_threads = True
+
+  if os.path.exists(socket_path):
+    os.unlink(socket_path)
+  server = Server(socket_path, JobHandler)
+  sys.stderr.write("Listening on %s\n" % socket_path)
+  try:
+    server.serve_forever()
+  finally:
+    os.unlink(socket_path)
 
+def submit_job(socket_path, port_name, script, settings):
+  # Send a job to a running daemon and relay its output
+  import os, sys, json, socket
+  for step in script:
+    # The daemon may be running somewhere else
+    if step[0] in ('download', 'ram_run') and len(step) > 1:
+      step[1] = os.path.abspath(step[1])
+  sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+  sock.connect(socket_path)
+  job = {'port': port_name, 'script': script}
+  job.update(settings)
+  sock.sendall(json.dumps(job) + "\n")
+  ok = False
+  for line in sock.makefile():
+    if line.startswith("RESULT "):
+      ok = line.strip() == "RESULT OK"
+    else:
+      sys.stdout.write(line)
+      sys.stdout.flush()
+  sock.close()
+  return ok
+
+if __name__ == '__main__':
+  import sys
+  args = [a for a in sys.argv[1:] if not a.startswith('--')]
+  flags = [a for a in sys.argv[1:] if a.startswith('--')]
+  if (len(args) < 2):
+    print_usage()
+    sys.exit(1)
+    
+  use_libusb = False
+  daemon_socket = None
+  settings = {'window': 1, 'verbose': False, 'baud': SERIAL_BAUD}
+  for flag in flags:
+    if flag == '--libusb':
+      use_libusb = True
+    elif flag == '--verbose':
+      settings['verbose'] = True
+    elif flag == '--resume':
+      settings['resume'] = True
+    elif flag == '--enter':
+      settings['enter'] = True
+    elif flag.startswith('--baud='):
+      settings['baud'] = int(flag[7:])
+    elif flag.startswith('--window='):
+      settings['window'] = int(flag[9:])
+    elif flag.startswith('--daemon='):
+      daemon_socket = flag[9:]
+    elif flag.startswith('--capture='):
+      settings['capture'] = flag[10:]
+    else:
+      print_usage()
+      sys.exit(1)
+    
+  if (args[0] == 'daemon'):
+    run_daemon(args[1], use_libusb)
+    sys.exit(0)
+    
+  serial_port_name = args[0]
+  script = split_script(args[1:])
+  
+  if daemon_socket is not None:
+    ok = submit_job(daemon_socket, serial_port_name, script, settings)
+  else:
+    if settings.get('enter'):
+      serial_port = open_bootloader(serial_port_name, use_libusb,
+                                    settings['baud'])
+    else:
+      serial_port = open_port(serial_port_name, use_libusb, settings['baud'])
+    if settings.get('capture'):
+      serial_port = CapturePort(serial_port, settings['capture'])
+    try:
+      ok = run_script(serial_port, script, settings)
+    finally:
+      serial_port.close()
+  
+  sys.exit(0 if ok else 1)
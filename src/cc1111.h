@@ -143,6 +143,11 @@ __sfr __at 0xC6 CLKCON;		/* Clock Control */
 #define SLEEP_MODE_PM3		(3 << 0)
 #define SLEEP_MODE_MASK		(3 << 0)
 
+/* Sleep timer, 24 bits counting at 32 kHz. Reading ST0 latches ST1 and ST2 */
+__sfr __at 0x95 ST0;
+__sfr __at 0x96 ST1;
+__sfr __at 0x97 ST2;
+
 /* PCON 0x87 */
 __sfr __at 0x87 PCON;		/* Power Mode Control Register */
 
@@ -263,6 +268,10 @@ __sfr __at 0xA9 IP0;	/* Interrupt Priority 0 */
 /*
  * Timer 1
  */
+__sfr __at 0xE2 T1CNTL;		/* Reading T1CNTL latches T1CNTH */
+__sfr __at 0xE3 T1CNTH;
+__sfr __at 0xE4 T1CTL;
+
 #define T1CTL_MODE_SUSPENDED	(0 << 0)
 #define T1CTL_MODE_FREE		(1 << 0)
 #define T1CTL_MODE_MODULO	(2 << 0)
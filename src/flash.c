@@ -21,20 +21,81 @@
 #include "flash.h"
 #include "main.h"
 #include "usb.h"
+#include "stats.h"
+#include "trace.h"
+#include "xmem.h"
 
 static __xdata struct cc_dma_channel dma0_config;
 uint32_t erased_page_flags = 0;
+// Pages written to since they were erased, and pages the writes have since
+// moved on from, used to work out where an interrupted download got to
+uint32_t written_page_flags = 0;
+uint32_t complete_page_flags = 0;
+uint8_t flash_committed_page = 0xFF;
 
-void flash_erase_page(uint8_t page) {
-  // Don't let's erase the bootloader, please
-  if (page < USER_FIRST_PAGE)
-    return;
-  
-  // Waiting for the flash controller to be ready
-  while (FCTL & FCTL_BUSY) {}
-  
+// Command queue feeding the flash controller. head and tail are free running
+// counters, the slot in use is selected by masking with FLASH_QUEUE_LEN-1.
+static __xdata struct flash_cmd flash_queue[FLASH_QUEUE_LEN];
+static volatile uint8_t flash_queue_head = 0;
+static volatile uint8_t flash_queue_tail = 0;
+static volatile uint8_t flash_state = FLASH_STATE_IDLE;
+// Set if the operation in flight is the one at the queue tail, rather than an
+// erase ahead or a flash_write() started directly
+static volatile uint8_t flash_inflight_queued = 0;
+
+// Pages declared by the host that will be written this session, erased ahead
+// of the write cursor while the flash controller would otherwise be idle.
+// In XRAM as flash_service() also runs for the payload's services, after its
+// startup code has cleared internal RAM.
+static __xdata uint8_t erase_ahead_next = 0xFF;
+static __xdata uint8_t erase_ahead_last = 0;
+static __xdata uint8_t flash_write_page = 0;
+
+static void flash_mark_erased(uint8_t page) {
   // Set bit showing that the flash page has been erased
   erased_page_flags |= ((uint32_t)1 << page);
+  written_page_flags &= ~((uint32_t)1 << page);
+  complete_page_flags &= ~((uint32_t)1 << page);
+}
+
+static void flash_retire() {
+  // The operation in flight is done, drop it from the queue if it came from
+  // there. More may have been queued behind a direct one since it started.
+  flash_state = FLASH_STATE_IDLE;
+  if (flash_inflight_queued)
+    flash_queue_tail++;
+  flash_inflight_queued = 0;
+}
+
+void flash_dma_isr() __interrupt 8 {
+  DMAIF = 0;
+  if (DMAIRQ & DMAIRQ_DMAIF0) {
+    DMAIRQ &= ~DMAIRQ_DMAIF0;
+    // Same as flash_retire(), kept inline so the ISR doesn't share its overlay
+    if (flash_state == FLASH_STATE_WRITE) {
+      flash_state = FLASH_STATE_IDLE;
+      if (flash_inflight_queued)
+        flash_queue_tail++;
+      flash_inflight_queued = 0;
+      trace(TRACE_DMA_END, 0);
+    }
+  }
+}
+
+static void flash_erase_start(uint8_t page) {
+  // Whoever asked, never erase the bootloader or past the end of flash
+  uint8_t allowed = (page >= USER_FIRST_PAGE && page <= USER_LAST_PAGE);
+#ifdef JOURNAL
+  allowed |= (page == JOURNAL_PAGE);
+#endif
+  if (!allowed) {
+    flash_retire();
+    return;
+  }
+  
+  flash_state = FLASH_STATE_ERASE;
+  stats.erases++;
+  trace(TRACE_ERASE_START, page);
   
   // Configure flash controller for a flash page erase
   // FADDRH[5:1] contains the page to erase
@@ -44,14 +105,9 @@ void flash_erase_page(uint8_t page) {
   FADDRH = page << 1;
   FADDRL = 0x00;
 
-  // Erase the page that will be written to
+  // Erase the page, completion is picked up by flash_service()
   FCTL |=  FCTL_ERASE;
   nop(); // Required, see datasheet
-  
-  // Wait for the erase operation to complete
-  while (FCTL & FCTL_BUSY) {}
-  
-  //FCTL &=  ~FCTL_ERASE;
 }
 
 void flash_write_trigger() {
@@ -83,7 +139,7 @@ void flash_write_trigger() {
   __endasm;
 }
 
-void flash_write(uint16_t buff[], uint16_t len, uint16_t flash_addr) {
+static void flash_write_start(uint16_t buff[], uint16_t len, uint16_t flash_addr) {
   // NOTE: len is the number of 16-bit words to transfer
 
   // Setup DMA descriptor
@@ -103,35 +159,217 @@ void flash_write(uint16_t buff[], uint16_t len, uint16_t flash_addr) {
   dma0_config.cfg1 = \
     DMA_CFG1_SRCINC_1 | \
     DMA_CFG1_DESTINC_0 | \
+    DMA_CFG1_IRQMASK | \
     DMA_CFG1_PRIORITY_HIGH;
   
   // Point DMA controller at our DMA descriptor
   DMA0CFGH = ((uint16_t)&dma0_config >> 8) & 0x00FF;
   DMA0CFGL = (uint16_t)&dma0_config & 0x00FF;
 
-  // Waiting for the flash controller to be ready
-  while (FCTL & FCTL_BUSY) {}
-
   // Configure the flash controller
   FWT = FLASH_FWT;
   FADDRH = (flash_addr >> 9) & 0x3F;
   FADDRL = (flash_addr >> 1) & 0xFF;
 
+  flash_state = FLASH_STATE_WRITE;
+  stats.writes++;
+  trace(TRACE_DMA_START, flash_addr >> 10);
+
   // Arm the DMA channel, so that a DMA trigger will initiate DMA writing
   DMAARM |= DMAARM_DMAARM0;
 
-  // Enable flash write - triggers the DMA transfer
+  // Enable flash write - triggers the DMA transfer. Completion is signalled
+  // by the DMA interrupt, or picked up by flash_service() if interrupts are off.
   flash_write_trigger();
+}
+
+void flash_service() {
+  __xdata struct flash_cmd *cmd;
+  uint8_t page;
+  
+  __critical {
+    // Retire a finished write here too in case interrupts are disabled
+    if (flash_state == FLASH_STATE_WRITE && (DMAIRQ & DMAIRQ_DMAIF0)) {
+      DMAIRQ &= ~DMAIRQ_DMAIF0;
+      flash_retire();
+      trace(TRACE_DMA_END, 0);
+    }
+    if (flash_state == FLASH_STATE_ERASE && !(FCTL & FCTL_BUSY)) {
+      flash_retire();
+      trace(TRACE_ERASE_END, 0);
+    }
+  }
   
-  // Wait for DMA transfer to complete
-  while (!(DMAIRQ & DMAIRQ_DMAIF0)) {}
+  // Start the next queued command once the flash controller is free
+  if (flash_state != FLASH_STATE_IDLE)
+    return;
+  if (FCTL & (FCTL_BUSY | FCTL_SWBSY))
+    return;
+  
+  if (flash_queue_tail == flash_queue_head) {
+    // Nothing queued, use the time to erase upcoming pages. Stay within a few
+    // pages of the write cursor so a write never waits long behind an erase.
+    while (erase_ahead_next <= erase_ahead_last &&
+           erase_ahead_next <= flash_write_page + FLASH_ERASE_AHEAD) {
+      page = erase_ahead_next++;
+      if (!flash_erased_page(page)) {
+        flash_mark_erased(page);
+        flash_inflight_queued = 0;
+        flash_erase_start(page);
+        break;
+      }
+    }
+    return;
+  }
+  
+  cmd = &flash_queue[flash_queue_tail & (FLASH_QUEUE_LEN-1)];
+  flash_inflight_queued = 1;
+  if (cmd->cmd == FLASH_CMD_ERASE)
+    flash_erase_start(cmd->addr);
+  else
+    flash_write_start((uint16_t*)cmd->data, cmd->len, cmd->addr);
+}
 
+void flash_wait() {
+  uint32_t start = stats_now();
+  
+  // Block until every queued command has been completed
+  while (flash_state != FLASH_STATE_IDLE || flash_queue_tail != flash_queue_head)
+    flash_service();
+  
   // Wait until flash controller not busy
   while (FCTL & (FCTL_BUSY | FCTL_SWBSY)) {}
   
-  // By now, the transfer is completed, so the transfer count is reached.
-  // The DMA channel 0 interrupt flag is then set, so we clear it here.
-  DMAIRQ &= ~DMAIRQ_DMAIF0;
+  stats.flash_wait_ticks += stats_since(start);
+}
+
+static __xdata struct flash_cmd *flash_queue_alloc() {
+  // Only block if the queue is full
+  while ((uint8_t)(flash_queue_head - flash_queue_tail) == FLASH_QUEUE_LEN)
+    flash_service();
+  return &flash_queue[flash_queue_head & (FLASH_QUEUE_LEN-1)];
+}
+
+static void flash_queue_push() {
+  flash_queue_head++;
+  flash_service();
+}
+
+static void flash_queue_erase(uint8_t page) {
+  __xdata struct flash_cmd *cmd;
+  
+  flash_mark_erased(page);
+  
+  cmd = flash_queue_alloc();
+  cmd->cmd = FLASH_CMD_ERASE;
+  cmd->addr = page;
+  flash_queue_push();
+}
+
+#ifdef JOURNAL
+// Download journal, a log of 16-bit entries in the reserved JOURNAL_PAGE.
+// Entries are only ever appended, each one into a word still reading 0xFFFF,
+// and go through the flash queue so they land after the data they describe.
+static uint16_t journal_next = 0;
+static uint8_t journal_state = JOURNAL_IDLE;
+static uint8_t journal_restart = 0;
+
+static void journal_append(uint8_t tag, uint8_t page) {
+  __xdata struct flash_cmd *cmd;
+  
+  if (journal_next >= 512)
+    return;
+  
+  cmd = flash_queue_alloc();
+  cmd->cmd = FLASH_CMD_WRITE;
+  cmd->len = 1;
+  cmd->addr = JOURNAL_PAGE*1024 + journal_next*2;
+  cmd->data[0] = page;
+  cmd->data[1] = tag;
+  flash_queue_push();
+  journal_next++;
+}
+
+static void journal_scan() {
+  // Rebuild the state of the last download from the journal
+  __xdata uint8_t *p = (__xdata uint8_t*)(JOURNAL_PAGE*1024);
+  
+  for (journal_next=0; journal_next<512; journal_next++, p+=2) {
+    switch (p[1]) {
+      case JOURNAL_BEGIN:
+        journal_state = JOURNAL_OPEN;
+        complete_page_flags = 0;
+        break;
+      case JOURNAL_COMMIT:
+        complete_page_flags |= ((uint32_t)1 << p[0]);
+        break;
+      case JOURNAL_END:
+        journal_state = JOURNAL_IDLE;
+        break;
+      case 0xFF:
+        return;
+    }
+  }
+}
+
+static void journal_write_started() {
+  // Start a new journal on the first write of a download, unless we are
+  // carrying on with one that was interrupted
+  if (journal_state == JOURNAL_OPEN && !journal_restart)
+    return;
+  flash_queue_erase(JOURNAL_PAGE);
+  journal_next = 0;
+  journal_state = JOURNAL_OPEN;
+  journal_restart = 0;
+  journal_append(JOURNAL_BEGIN, 0);
+}
+
+uint8_t flash_journal_open() {
+  return journal_state == JOURNAL_OPEN;
+}
+#endif
+
+void flash_init() {
+#ifdef JOURNAL
+  journal_scan();
+#endif
+  
+  // Enable the DMA interrupt so finished writes are retired straight away
+  DMAIF = 0;
+  IEN1 |= IEN1_DMAIE;
+}
+
+void flash_finish() {
+  // The download is over, the last page written is complete too
+#ifdef JOURNAL
+  if (journal_state == JOURNAL_OPEN && !journal_restart && written_page_flags) {
+    journal_append(JOURNAL_COMMIT, flash_write_page);
+    journal_append(JOURNAL_END, 0);
+    journal_state = JOURNAL_IDLE;
+  }
+#endif
+  if (written_page_flags & ((uint32_t)1 << flash_write_page))
+    complete_page_flags |= ((uint32_t)1 << flash_write_page);
+  flash_wait();
+}
+
+void flash_erase_page(uint8_t page) {
+  // Don't let's erase the bootloader, please
+  if (page < USER_FIRST_PAGE || page > USER_LAST_PAGE)
+    return;
+  
+  flash_queue_erase(page);
+  flash_wait();
+}
+
+void flash_write(uint16_t buff[], uint16_t len, uint16_t flash_addr) {
+  // NOTE: len is the number of 16-bit words to transfer
+  
+  // Writes straight from the caller's buffer so let everything queued go first
+  flash_wait();
+  flash_inflight_queued = 0;
+  flash_write_start(buff, len, flash_addr);
+  flash_wait();
 }
 
 uint8_t flash_erased_page(uint8_t page) {
@@ -144,31 +382,137 @@ uint8_t flash_erased_page(uint8_t page) {
 
 void flash_check_and_erase(uint8_t page) {
   // Erase page only if it was never previously erased
-  if (!flash_erased_page(page))
-    flash_erase_page(page);
+  if (page >= USER_FIRST_PAGE && page <= USER_LAST_PAGE && !flash_erased_page(page))
+    flash_queue_erase(page);
 }
 
-void flash_check_erase_and_write(uint16_t buff[], uint16_t len, uint16_t flash_addr) {
+void flash_check_erase_and_write(__xdata uint16_t buff[], uint16_t len, uint16_t flash_addr) {
+  // NOTE: len is the number of 16-bit words to transfer, at most
+  // FLASH_CHUNK_LEN bytes worth
+  __xdata struct flash_cmd *cmd;
   uint8_t i, start_page, end_page;
   
   start_page = flash_addr / 1024;
-  end_page = (flash_addr + len) / 1024;
+  end_page = (flash_addr + 2*len - 1) / 1024;
   
   // Check and erase pages in range
   for (i=start_page; i<=end_page; i++)
     flash_check_and_erase(i);
   
-  flash_write(buff, len, flash_addr);
+#ifdef JOURNAL
+  journal_write_started();
+#endif
+  
+  // Downloads are written in order, so once the writes move on to a later
+  // page the page before is complete
+  if (start_page > flash_write_page &&
+      (written_page_flags & ((uint32_t)1 << flash_write_page))) {
+    complete_page_flags |= ((uint32_t)1 << flash_write_page);
+    flash_committed_page = flash_write_page;
+#ifdef JOURNAL
+    journal_append(JOURNAL_COMMIT, flash_write_page);
+#endif
+  }
+  for (i=start_page; i<=end_page; i++)
+    written_page_flags |= ((uint32_t)1 << i);
+  flash_write_page = end_page;
+  
+  // Queue the write behind any erases, copying the data into the queue slot
+  cmd = flash_queue_alloc();
+  cmd->cmd = FLASH_CMD_WRITE;
+  cmd->len = len;
+  cmd->addr = flash_addr;
+  xmem_copy(cmd->data, (__xdata uint8_t*)buff, 2*len);
+  flash_queue_push();
+}
+
+uint8_t flash_page_state(uint8_t page) {
+  uint32_t mask = (uint32_t)1 << page;
+  if (complete_page_flags & mask)
+    return FLASH_PAGE_COMPLETE;
+  if (written_page_flags & mask)
+    return FLASH_PAGE_PARTIAL;
+  if (erased_page_flags & mask)
+    return FLASH_PAGE_ERASED;
+  return FLASH_PAGE_UNTOUCHED;
 }
 
 void flash_reset() {
   erased_page_flags = 0;
+  written_page_flags = 0;
+  complete_page_flags = 0;
+  erase_ahead_next = 0xFF;
+#ifdef JOURNAL
+  // Whatever was in the journal no longer describes what is in flash
+  journal_restart = 1;
+#endif
+}
+
+uint8_t flash_page_blank(uint8_t page) {
+  // Check if every byte of a page reads as erased
+  __xdata uint8_t *p = (__xdata uint8_t*)((uint16_t)page << 10);
+  uint16_t i;
+  for (i=0; i<1024; i++) {
+    if (*p++ != 0xFF)
+      return 0;
+  }
+  return 1;
+}
+
+void flash_erase_range(uint8_t first_page, uint8_t last_page) {
+  // Erase a range of pages back to back, skipping any that are already blank
+  uint8_t i;
+  
+  if (first_page < USER_FIRST_PAGE)
+    first_page = USER_FIRST_PAGE;
+  if (last_page > USER_LAST_PAGE)
+    last_page = USER_LAST_PAGE;
+  
+  // Pending writes could land on a page we are about to check
+  flash_wait();
+  
+  for (i=first_page; i<=last_page; i++) {
+    if (flash_page_blank(i))
+      flash_mark_erased(i);
+    else
+      flash_queue_erase(i);
+  }
+  flash_wait();
+}
+
+void flash_erase_ahead(uint8_t first_page, uint8_t last_page) {
+  // Never erase the bootloader or past the end of flash
+  if (first_page < USER_FIRST_PAGE)
+    first_page = USER_FIRST_PAGE;
+  if (last_page > USER_LAST_PAGE)
+    last_page = USER_LAST_PAGE;
+  if (first_page > last_page) {
+    // None of it is in user flash
+    erase_ahead_next = 0xFF;
+    return;
+  }
+  
+  erase_ahead_next = first_page;
+  erase_ahead_last = last_page;
+  flash_write_page = first_page;
+  flash_service();
+}
+
+void flash_abort() {
+  // Data already queued is written, but nothing more is erased for a
+  // download the host has given up on
+  erase_ahead_next = 0xFF;
+  flash_wait();
 }
 
 void flash_erase_all_user() {
   // Erase all user flash pages
   uint8_t i;
-  for (i=USER_FIRST_PAGE; i<FLASH_PAGES; i++)
-    flash_erase_page(i);
+  for (i=USER_FIRST_PAGE; i<=USER_LAST_PAGE; i++)
+    flash_queue_erase(i);
+#ifdef JOURNAL
+  journal_restart = 1;
+#endif
+  flash_wait();
 }
 
@@ -27,19 +27,89 @@
 // Address of flash controller data register
 #define FLASH_FWDATA_ADDR 0xDFAF
 
-void flash_erase_page(uint8_t page);
+// Number of erase/write commands that can be waiting for the flash controller,
+// must be a power of two
+#define FLASH_QUEUE_LEN 4
+// Largest write that can be queued in bytes, one Intel HEX data record plus
+// padding to align it onto 16-bit words
+#define FLASH_CHUNK_LEN 18
+
+// How many pages beyond the one currently being written are erased ahead of
+// time when the host has declared the range it is going to write
+#define FLASH_ERASE_AHEAD 2
+
+#define FLASH_CMD_ERASE 0
+#define FLASH_CMD_WRITE 1
+
+#define FLASH_STATE_IDLE  0
+#define FLASH_STATE_ERASE 1
+#define FLASH_STATE_WRITE 2
+
+// Page states reported by flash_page_state()
+#define FLASH_PAGE_UNTOUCHED 0 // Not erased this session
+#define FLASH_PAGE_ERASED    1 // Erased, nothing written yet
+#define FLASH_PAGE_PARTIAL   2 // Written to, more writes may follow
+#define FLASH_PAGE_COMPLETE  3 // Writes have moved on to a later page
+
+// Journal entry tags, the low byte of each entry holds a page number
+#define JOURNAL_BEGIN  0xB0 // Download started
+#define JOURNAL_COMMIT 0xC0 // Page completely written
+#define JOURNAL_END    0xE0 // Download finished
 
+#define JOURNAL_IDLE 0
+#define JOURNAL_OPEN 1
+
+struct flash_cmd {
+  uint8_t   cmd;
+  uint8_t   len;   // Number of 16-bit words to write
+  uint16_t  addr;  // Flash address to write to, or page number to erase
+  uint8_t   data[FLASH_CHUNK_LEN];
+};
+
+// DMA interrupt handler, retires finished flash writes
+void flash_dma_isr() __interrupt 8;
+
+void flash_init();
+// Advance the command queue, call this whenever there is nothing else to do
+void flash_service();
+// Wait until all queued commands have completed
+void flash_wait();
+
+// Erase a page, waiting for it to complete
+void flash_erase_page(uint8_t page);
+// Write to flash straight from buff, waiting for it to complete
 void flash_write(uint16_t buff[], uint16_t len, uint16_t flash_addr);
 
 // Check if a page was previously erased
 uint8_t flash_erased_page(uint8_t page);
 // Erase page only if it was never previously erased
 void flash_check_and_erase(uint8_t page);
-// Write to flash, erasing pages as needed that have never yet been erased
-void flash_check_erase_and_write(uint16_t buff[], uint16_t len, uint16_t flash_addr);
+// Queue a write to flash, erasing pages as needed that have never yet been erased.
+// Returns as soon as the data is queued, only blocking if the queue is full.
+void flash_check_erase_and_write(__xdata uint16_t buff[], uint16_t len, uint16_t flash_addr);
+// Mark the download as finished, waiting for all writes to complete
+void flash_finish();
+#ifdef JOURNAL
+// Check if the journal shows a download that was started but never finished
+uint8_t flash_journal_open();
+#endif
+// How far a download has got with a page, one of the FLASH_PAGE_ states
+uint8_t flash_page_state(uint8_t page);
 // Reset record of which pages have been erased
 void flash_reset();
 // Erase all user flash pages
 void flash_erase_all_user();
+// Check if a page reads as all 0xFF
+uint8_t flash_page_blank(uint8_t page);
+// Erase pages first_page to last_page, skipping pages that are already blank
+void flash_erase_range(uint8_t first_page, uint8_t last_page);
+// Erase pages first_page to last_page in the background, ahead of the writes
+void flash_erase_ahead(uint8_t first_page, uint8_t last_page);
+// Stop erasing ahead and wait for what has already been queued to finish
+void flash_abort();
+
+// Last page the writes moved on from, marking it complete, or 0xFF. Cleared by
+// whoever reports it.
+extern uint8_t flash_committed_page;
 
 #endif // _FLASH_H_
\ No newline at end of file
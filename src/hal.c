@@ -44,3 +44,9 @@ void usb_down() {
   P1_0 = 0;
   P1DIR &= ~1;
 }
+
+void uart_pins_init() {
+  // USART0 at its first location, P0_3 TX and P0_2 RX
+  PERCFG = (PERCFG & ~PERCFG_U0CFG_ALT_MASK) | PERCFG_U0CFG_ALT_1;
+  P0SEL |= (1 << 3) | (1 << 2);
+}
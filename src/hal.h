@@ -27,4 +27,6 @@ void led_off();
 void usb_up();
 void usb_down();
 
+void uart_pins_init();
+
 #endif // _HAL_H_
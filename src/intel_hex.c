@@ -20,8 +20,11 @@
 #include "cc1111.h"
 #include "intel_hex.h"
 #include "usb.h"
+#include "link.h"
 #include "main.h"
 #include "flash.h"
+#include "stats.h"
+#include "trace.h"
 
 uint8_t hex4(char c) {
   // Converts a character representation of a hexadecimal nibble
@@ -77,10 +80,20 @@ uint8_t ihx_check_line(char line[]) {
   
   checksum = ihx_data_byte(line, byte_count);
 
-  if (record_type > 0x01 && (record_type < 0x22 || record_type > 0x25))
+  if (record_type > 0x01 && (record_type < IHX_RECORD_RESET || record_type > IHX_RECORD_LAST))
     return IHX_BAD_RECORD_TYPE;
     
-  if (record_type == IHX_RECORD_DATA && (address < USER_CODE_BASE || address > FLASH_SIZE))
+  if (record_type == IHX_RECORD_DATA &&
+      (address < USER_CODE_BASE || address > USER_CODE_END - byte_count))
+   return IHX_BAD_ADDRESS;
+   
+  if (record_type == IHX_RECORD_RAM_DATA &&
+      (address < RAM_CODE_BASE || address > RAM_CODE_END - byte_count))
+   return IHX_BAD_ADDRESS;
+  
+  // The entry point has to be inside the loaded region, not just past it
+  if (record_type == IHX_RECORD_RAM_RUN &&
+      (address < RAM_CODE_BASE || address >= RAM_CODE_END))
    return IHX_BAD_ADDRESS;
    
   sum = 0;
@@ -95,17 +108,68 @@ uint8_t ihx_check_line(char line[]) {
   return IHX_OK;
 }
 
-void ihx_readline(char line[]) {
+static char ihx_getchar(uint8_t in_record) {
+  char c;
+  uint8_t waiting = 0;
+  uint32_t start;
+  while (1) {
+    // Vendor requests are carried out between records, except an abort
+    if (usb_vendor_cmd == VENDOR_REQ_ABORT || (usb_vendor_cmd && !in_record))
+      c = 0;
+    else
+      c = link_pollchar();
+    if (c != LINK_READ_AGAIN) {
+      if (waiting)
+        stats.host_wait_ticks += stats_since(start);
+      return c;
+    }
+    if (!waiting) {
+      start = stats_now();
+      waiting = 1;
+      if (!in_record)
+        trace(TRACE_IDLE, 0);
+    }
+    // Keep the flash controller busy while waiting for the host
+    flash_service();
+  }
+}
+
+void ihx_readline(__xdata char line[]) {
+  // Returns an empty line if a vendor request needs attention instead
   char c;
-  uint8_t len;
+  uint8_t len, n;
   
   // Wait for start of record
-  while (usb_getchar() != ':') {}
+  while ((c = ihx_getchar(0)) != ':') {
+    if (c == 0) {
+      line[0] = 0;
+      return;
+    }
+  }
   line[0] = ':';
   
-  // Read until newline
+  // Read until newline, taking whatever has already arrived in one go
   len = 1;
-  while (len < (IHX_MAX_LEN*2)+13 && (c = usb_getchar()) != '\n') {
+  while (len < (IHX_MAX_LEN*2)+13) {
+    if (usb_vendor_cmd != VENDOR_REQ_ABORT) {
+      n = link_read_chunk(&line[len], (IHX_MAX_LEN*2)+13 - len);
+      if (n) {
+        len += n;
+        if (line[len-1] == '\n') {
+          len--;
+          break;
+        }
+        continue;
+      }
+    }
+    // Nothing waiting, wait for the next byte
+    c = ihx_getchar(1);
+    if (c == 0) {
+      line[0] = 0;
+      return;
+    }
+    if (c == '\n')
+      break;
     line[len++] = c;
   }
   line[len+1] = 0;
@@ -131,14 +195,19 @@ void ihx_write(char line[]) {
       if (address & 1) {
         // Odd start address
         // (byte_count+1)/2 == number of 16-bit words to transfer, rounded up
-        flash_check_erase_and_write((uint16_t*)buff, (byte_count+2)/2, address-1);
+        flash_check_erase_and_write((__xdata uint16_t*)buff, (byte_count+2)/2, address-1);
       } else {
         // Even start address
         // (byte_count+1)/2 == number of 16-bit words to transfer, rounded up
-        flash_check_erase_and_write((uint16_t*)(buff+1), (byte_count+1)/2, address);
+        flash_check_erase_and_write((__xdata uint16_t*)(buff+1), (byte_count+1)/2, address);
       }
       
       break;
+    case IHX_RECORD_RAM_DATA:
+      // Straight into RAM, no need to go via the flash controller
+      for (i=0; i<byte_count; i++)
+        ((__xdata uint8_t*)address)[i] = ihx_data_byte(line, i);
+      break;
     case IHX_RECORD_EOF:
       break;
   }
@@ -191,11 +260,11 @@ void ihx_read_print(__xdata uint8_t* start_addr, uint16_t len) {
     buff[44] = 0;
     
     // Print buffer over usb
-    usb_putstr(buff);
+    link_putstr(buff);
     
     // Updates for next go round
     start_addr += 0x10;
     len -= 0x10;
   }
-  usb_putstr(":00000001FF\n");
+  link_putstr(":00000001FF\n");
 }
@@ -56,6 +56,97 @@
 // xxxx - Start address, yyyy - Num bytes to read, zz - Checksum
 #define IHX_RECORD_READ  0x25
 
+// Declares the range of pages that are about to be written so they can be
+// erased in the background ahead of the data records. Every page in it is
+// erased, so an image with gaps declares each run of pages separately. A new
+// range replaces the last one, pages outside user flash are left alone.
+// :02000026xxyyzz
+// xx - First page, yy - Last page, zz - Checksum
+#define IHX_RECORD_ERASE_AHEAD  0x26
+
+// Erases a range of user code flash pages, skipping pages that are already
+// blank
+// :02000027xxyyzz
+// xx - First page, yy - Last page, zz - Checksum
+#define IHX_RECORD_ERASE_RANGE  0x27
+
+// Reports the state of every flash page as a line of hex digits, one per page
+// (0 - untouched, 1 - erased, 2 - partially written, 3 - complete)
+// :00000028D8
+#define IHX_RECORD_PAGE_STATE  0x28
+
+// Reports what the bootloader supports as a line of space separated hex fields
+// :00000029D7
+// Reply: vvvv ssss pppp bbbb eeee ll rrrr ff
+// vvvv - Bootloader version, ssss - Flash size, pppp - Page size,
+// bbbb - USER_CODE_BASE, eeee - USER_CODE_END, ll - IHX_MAX_LEN,
+// rrrr - Custom record types supported, bit n set for record type 0x22+n,
+// ff - Optional features (FEATURE_ flags in main.h)
+#define IHX_RECORD_DEVICE_INFO  0x29
+
+// Same as a data record but writes into the RAM_CODE_BASE to RAM_CODE_END
+// region of RAM instead of flash
+// :ccaaaa2Axxxx..zz
+#define IHX_RECORD_RAM_DATA  0x2A
+
+// Runs code loaded into RAM, starting from the address given
+// :0000aaaa2Bzz
+// aaaa - Start address, zz - Checksum
+#define IHX_RECORD_RAM_RUN  0x2B
+
+// Selects where record results go, 00 - the bulk IN pipe with any data sent
+// back, 01 - notifications on the interrupt endpoint (see USB_NOTIFY_STATUS in
+// usb.h). The result of this record itself always goes on the bulk pipe.
+// :0100002Cxxyy
+// xx - Mode, yy - Checksum
+#define IHX_RECORD_STATUS_MODE  0x2C
+
+// Provisions the USB serial number, see SERIAL_ADDR in main.h. Only works once,
+// Bad Address is returned if a serial number is already there.
+// :ccaaaa2Dxxxx..zz
+// cc - Length, xxxx.. - ASCII serial number, zz - Checksum
+#define IHX_RECORD_SET_SERIAL  0x2D
+
+// Reports the performance counters (struct boot_stats in stats.h) as a line of
+// space separated hex fields, clearing them afterwards if xx is 01
+// :0100002Exxyy
+// Reply: rrrr e1e1 e2e2 e3e3 e4e4 e5e5 eeee wwww oooo iiii ffffffff hhhhhhhh tttttttt
+// rrrr - Records, e1e1..e5e5 - Records rejected with result 1..5,
+// eeee - Pages erased, wwww - Flash writes, oooo/iiii - USB packets out/in,
+// ffffffff - Ticks waiting for flash, hhhhhhhh - Ticks waiting for the host,
+// tttttttt - Ticks since the counters were cleared
+#define IHX_RECORD_STATS  0x2E
+
+// Dumps the event trace (see trace.h) as lines of 8 hex digits per entry,
+// oldest first, followed by an empty line. Clears the trace afterwards if xx
+// is 01. Only with TRACE.
+// :0100002Fxxyy
+#define IHX_RECORD_TRACE  0x2F
+
+// Link throughput test. After acknowledging, the bootloader moves nnnnnnnn
+// bytes of raw data over USB, either taking them from the host (mm = 00, sink),
+// sending each packet back as it comes in (01, echo) or sending them (02,
+// source). It then reports the USB packets it received and sent, how long
+// the test took in sleep timer ticks and the bytes actually moved, fewer than
+// asked for if the host stopped for a second or aborted. Result Invalid on
+// the UART.
+// :05000030mmnnnnnnnnzz
+// Reply: oooo iiii tttttttt bbbbbbbb
+#define IHX_RECORD_LINKTEST  0x30
+
+// Highest custom record type understood
+#define IHX_RECORD_LAST  IHX_RECORD_LINKTEST
+
+// Custom record types are numbered contiguously from IHX_RECORD_RESET, less
+// the ones for options that aren't built in
+#ifdef TRACE
+#define IHX_RECORDS_OPTIONAL  0
+#else
+#define IHX_RECORDS_OPTIONAL  (1 << (IHX_RECORD_TRACE - IHX_RECORD_RESET))
+#endif
+#define IHX_RECORDS_SUPPORTED  \
+  (((1U << (IHX_RECORD_LAST - IHX_RECORD_RESET + 1)) - 1) & ~IHX_RECORDS_OPTIONAL)
+
 
 uint8_t hex4(char c);
 uint8_t hex8(char s[]);
@@ -65,7 +156,7 @@ void to_hex8_ascii(char buff[], uint8_t x);
 void to_hex16_ascii(char buff[], uint16_t x);
 
 uint8_t ihx_check_line(char line[]);
-void ihx_readline(char line[]);
+void ihx_readline(__xdata char line[]);
 void ihx_write(char line[]);
 uint8_t ihx_record_type(char line[]);
 uint16_t ihx_record_address(char line[]);
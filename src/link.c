@@ -0,0 +1,101 @@
+/*
+ * CC Bootloader - Link to the host
+ *
+ * Fergus Noble (c) 2011
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#include "cc1111.h"
+#include "main.h"
+#include "usb.h"
+#include "uart.h"
+#include "link.h"
+
+#ifdef UART_LINK
+
+// Set while the host is talking to us over USART0
+static uint8_t link_uart = 0;
+
+void link_init()
+{
+  usb_init();
+  uart_init();
+}
+
+void link_disable()
+{
+  uart_disable();
+}
+
+char link_pollchar()
+{
+  char c;
+
+  c = uart_pollchar();
+  if (c != UART_READ_AGAIN) {
+    if (!link_uart) {
+      // Don't leave a partial reply behind on the old link
+      usb_flush();
+      link_uart = 1;
+    }
+    return c;
+  }
+
+  c = usb_pollchar();
+  if (c != USB_READ_AGAIN && link_uart) {
+    uart_flush();
+    link_uart = 0;
+  }
+  return c;
+}
+
+uint8_t link_read_chunk(__xdata char *buff, uint8_t len)
+{
+  // The UART is left to link_pollchar(), a byte at a time
+  if (link_uart)
+    return 0;
+  return usb_read_chunk(buff, len);
+}
+
+void link_putchar(char c)
+{
+  if (link_uart)
+    uart_putchar(c);
+  else
+    usb_putchar(c);
+}
+
+void link_flush()
+{
+  if (link_uart)
+    uart_flush();
+  else
+    usb_flush();
+}
+
+void link_putstr(char* buff)
+{
+  while (*buff) {
+    link_putchar(*buff++);
+  }
+  link_flush();
+}
+
+uint8_t link_is_usb()
+{
+  return !link_uart;
+}
+
+#endif // UART_LINK
@@ -0,0 +1,54 @@
+/*
+ * CC Bootloader - Link to the host
+ *
+ * Fergus Noble (c) 2011
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#ifndef _LINK_H_
+#define _LINK_H_
+
+// The command loop talks to the host through these. Normally they are just
+// the USB CDC driver. With UART_LINK (main.h) the bootloader also listens on
+// USART0 and answers on whichever link the last byte came in on.
+
+#ifdef UART_LINK
+
+void link_init();
+void link_disable();
+char link_pollchar();
+uint8_t link_read_chunk(__xdata char *buff, uint8_t len);
+void link_putchar(char c);
+void link_flush();
+void link_putstr(char* buff);
+uint8_t link_is_usb();
+
+#else
+
+#define link_init() usb_init()
+#define link_disable()
+#define link_pollchar() usb_pollchar()
+#define link_read_chunk(buff, len) usb_read_chunk(buff, len)
+#define link_putchar(c) usb_putchar(c)
+#define link_flush() usb_flush()
+#define link_putstr(buff) usb_putstr(buff)
+#define link_is_usb() 1
+
+#endif // UART_LINK
+
+// Same as USB_READ_AGAIN and UART_READ_AGAIN
+#define LINK_READ_AGAIN ((char) -1)
+
+#endif // _LINK_H_
@@ -17,14 +17,21 @@
  * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
  */
 
+#define _BOOTLOADER_
 #include "cc1111.h"
 #include "main.h"
 #include "usb.h"
+#include "link.h"
 #include "hal.h"
 #include "flash.h"
 #include "intel_hex.h"
+#include "services.h"
+#include "stats.h"
+#include "trace.h"
 
 uint8_t bootloader_running = 1;
+// Set if the payload asked for the bootloader, see enter_bootloader()
+uint8_t bootloader_requested = 0;
 
 void clock_init()
 {
@@ -44,7 +51,7 @@ void clock_init()
 
 #ifdef STDIO
 void putchar(char c) {
-    usb_putchar(c);
+    link_putchar(c);
 }
 #endif
  
@@ -62,18 +69,68 @@ void delay (unsigned char n) {
 uint8_t check_for_payload() {
   if (*((__xdata uint8_t*)USER_CODE_BASE) == 0xFF)
     return 0;
+  #ifdef JOURNAL
+  // Don't start a payload that was only partly downloaded
+  if (flash_journal_open())
+    return 0;
+  #endif
   else
     return 1;
 }
 
+uint8_t bootloader_features() {
+  // FEATURE_* flags for the build options
+  uint8_t features = 0;
+  
+  #ifdef TIMER
+  features |= FEATURE_TIMER;
+  #endif
+  #ifdef JOURNAL
+  features |= FEATURE_JOURNAL;
+  #endif
+  #ifdef USB_VENDOR_BULK
+  features |= FEATURE_VENDOR_BULK;
+  #endif
+  #ifdef WARM_HANDOFF
+  features |= FEATURE_WARM_HANDOFF;
+  #endif
+  features |= FEATURE_VENDOR_REQ;
+  #ifdef UART_LINK
+  features |= FEATURE_UART_LINK;
+  #endif
+  #ifdef TRACE
+  features |= FEATURE_TRACE;
+  #endif
+  
+  return features;
+}
+
 void jump_to_user() {
+  // Let any queued flash writes finish, and stop erasing ahead so the flash
+  // services don't carry on with it for the payload
+  flash_abort();
+  
   // Disable all interrupts
   EA = 0;
   IEN0 = IEN1 = IEN2 = 0;
   
+  #ifdef WARM_HANDOFF
+  if (usb_configuration) {
+    // Leave the link up and tell the payload about it
+    boot_handoff.version = HANDOFF_VERSION;
+    boot_handoff.clkcon = CLKCON;
+    boot_handoff.usb_address = USBADDR;
+    boot_handoff.usb_configuration = usb_configuration;
+    boot_handoff.features = bootloader_features();
+    boot_handoff.magic = HANDOFF_MAGIC;
+  } else
+  #endif
   // Bring down the USB link
   usb_down();
   
+  // Stop listening on the other link
+  link_disable();
+  
   // Flag bootloader not running
   bootloader_running = 0;
   
@@ -90,6 +147,42 @@ void jump_to_user() {
   }
 }
 
+void jump_to_ram(uint16_t address) {
+  // Let any queued flash writes finish, and stop erasing ahead so the flash
+  // services don't carry on with it for the payload
+  flash_abort();
+  
+  // Disable all interrupts
+  EA = 0;
+  IEN0 = IEN1 = IEN2 = 0;
+  
+  // Bring down the USB link
+  usb_down();
+  
+  // Stop listening on the other link
+  link_disable();
+  
+  // Flag bootloader not running
+  bootloader_running = 0;
+  
+  // Jump to the code loaded into RAM
+  ((void (*)(void))address)();
+  while (1) {}
+}
+
+void enter_bootloader() {
+  // Called from a running payload (or the USB ISR on its behalf), leave a
+  // note for the bootloader and reset into it
+  EA = 0;
+  bootloader_request = BOOTLOADER_REQUEST_MAGIC;
+  
+  // Drop off the bus so the host sees us go, the watchdog resets us about
+  // a second later
+  usb_down();
+  WDCTL = WDCTL_EN | WDCTL_MODE_WATCHDOG | WDCTL_INT_32768;
+  while (1) {}
+}
+
 #ifdef TIMER
 void setup_timer1() {
   // Clear Timer 1 channel 1 and overflow interrupt flag
@@ -161,7 +254,28 @@ void timer1_isr_forward() __naked {
   #endif
 }
 
+void dma_isr_forward() __naked {
+  __asm
+  	push acc
+  	mov	a, _bootloader_running
+  	jnz	dma_isr_forward_bootloader
+  	; Bootloader not running, jump into the payload ISR
+  	pop acc
+  	ljmp #(USER_CODE_BASE+0x43)
+  dma_isr_forward_bootloader:
+  	pop acc
+  	ljmp	_flash_dma_isr
+  __endasm;
+}
+
 uint8_t want_bootloader() {
+  // The payload asked for us, skip everything else
+  if (bootloader_request == BOOTLOADER_REQUEST_MAGIC) {
+    bootloader_request = 0;
+    bootloader_requested = 1;
+    return 1;
+  }
+  
   // Check if we want to the bootloader to run
   // Here is the place to check for things like USB power and jump straight to
   // user code under some conditions.
@@ -176,25 +290,185 @@ uint8_t want_bootloader() {
   return 1;
 }
 
+void send_device_info() {
+  // Reply to IHX_RECORD_DEVICE_INFO, see intel_hex.h for the format
+  __xdata char buff[38];
+  
+  to_hex16_ascii(&buff[0], BOOTLOADER_VERSION);
+  to_hex16_ascii(&buff[5], FLASH_SIZE);
+  to_hex16_ascii(&buff[10], 1024);
+  to_hex16_ascii(&buff[15], USER_CODE_BASE);
+  to_hex16_ascii(&buff[20], USER_CODE_END);
+  to_hex8_ascii(&buff[25], IHX_MAX_LEN);
+  to_hex16_ascii(&buff[28], IHX_RECORDS_SUPPORTED);
+  to_hex8_ascii(&buff[33], bootloader_features());
+  buff[4] = buff[9] = buff[14] = buff[19] = buff[24] = buff[27] = buff[32] = ' ';
+  buff[35] = '\n';
+  buff[36] = 0;
+  link_putstr(buff);
+}
+
+uint8_t set_serial(char line[]) {
+  // Provision the USB serial number, see SERIAL_ADDR
+  __xdata uint8_t buff[SERIAL_MAX_LEN];
+  __xdata uint8_t *serial = (__xdata uint8_t*)SERIAL_ADDR;
+  uint8_t len = hex8(&line[1]);
+  uint8_t i;
+  
+  if (len == 0 || len > SERIAL_MAX_LEN)
+    return IHX_INVALID;
+  // The slot can't be erased without erasing the bootloader, write it once
+  for (i=0; i<SERIAL_MAX_LEN; i++)
+    if (serial[i] != 0xFF)
+      return IHX_BAD_ADDRESS;
+  
+  for (i=0; i<SERIAL_MAX_LEN; i++)
+    buff[i] = (i < len) ? ihx_data_byte(line, i) : 0xFF;
+  flash_write((uint16_t*)buff, (len+1)/2, SERIAL_ADDR);
+  
+  // Used from the next time the host enumerates us
+  usb_serial_init();
+  return IHX_OK;
+}
+
+char *put_hex16(char *p, uint16_t x) {
+  to_hex16_ascii(p, x);
+  p[4] = ' ';
+  return p + 5;
+}
+
+char *put_hex32(char *p, uint32_t x) {
+  to_hex16_ascii(p, x >> 16);
+  return put_hex16(p + 4, x);
+}
+
+void send_stats(uint8_t clear) {
+  // Reply to IHX_RECORD_STATS, see intel_hex.h for the format
+  __xdata char buff[80];
+  char *p = buff;
+  uint8_t i;
+  
+  p = put_hex16(p, stats.records);
+  for (i=0; i<5; i++)
+    p = put_hex16(p, stats.errors[i]);
+  p = put_hex16(p, stats.erases);
+  p = put_hex16(p, stats.writes);
+  p = put_hex16(p, stats.usb_out_packets);
+  p = put_hex16(p, stats.usb_in_packets);
+  p = put_hex32(p, stats.flash_wait_ticks);
+  p = put_hex32(p, stats.host_wait_ticks);
+  p = put_hex32(p, stats_since(stats.start));
+  p[-1] = '\n';
+  p[0] = 0;
+  link_putstr(buff);
+  
+  if (clear)
+    stats_clear();
+}
+
+void send_status(uint8_t status) {
+  // Result of a record, on the interrupt endpoint if the host asked for that
+  trace(TRACE_ACK, status);
+  stats.records++;
+  if (status != IHX_OK && status <= IHX_RECORD_TOO_LONG)
+    stats.errors[status-1]++;
+  usb_vendor_status.records++;
+  usb_vendor_status.result = status + '0';
+  if (flash_committed_page != 0xFF)
+    usb_vendor_status.page = flash_committed_page;
+  if (usb_status_notify && link_is_usb() &&
+      usb_notify_status(status + '0', flash_committed_page)) {
+    flash_committed_page = 0xFF;
+  } else {
+    link_putchar(status + '0');
+    link_flush();
+  }
+}
+
+void run_linktest(char line[]) {
+  // Carry out IHX_RECORD_LINKTEST, see intel_hex.h for the format
+  __xdata char buff[29];
+  char *p = buff;
+  uint8_t mode = ihx_data_byte(line, 0);
+  uint16_t out_packets, in_packets;
+  uint32_t len, start;
+  
+  if (hex8(&line[1]) != 5 || mode > USB_LINKTEST_SOURCE || !link_is_usb()) {
+    send_status(IHX_INVALID);
+    return;
+  }
+  len = ((uint32_t)ihx_data_byte(line, 1) << 24) |
+        ((uint32_t)ihx_data_byte(line, 2) << 16) |
+        ((uint16_t)ihx_data_byte(line, 3) << 8) | ihx_data_byte(line, 4);
+  
+  // Keep flash DMA from stealing cycles during the test
+  flash_wait();
+  send_status(IHX_OK);
+  out_packets = stats.usb_out_packets;
+  in_packets = stats.usb_in_packets;
+  start = stats_now();
+  len -= usb_linktest(mode, len);
+  
+  p = put_hex16(p, stats.usb_out_packets - out_packets);
+  p = put_hex16(p, stats.usb_in_packets - in_packets);
+  p = put_hex32(p, stats_since(start));
+  p = put_hex32(p, len);
+  p[-1] = '\n';
+  p[0] = 0;
+  link_putstr(buff);
+}
+
+void vendor_command() {
+  // Carry out a vendor request received on EP0, see usb.h
+  switch (usb_vendor_cmd) {
+    case VENDOR_REQ_ABORT:
+      usb_discard();
+      flash_abort();
+      break;
+    case VENDOR_REQ_ERASE_RANGE:
+      flash_erase_range(usb_vendor_arg[0], usb_vendor_arg[1]);
+      break;
+    case VENDOR_REQ_RUN:
+      flash_finish();
+      jump_to_user();
+      break;
+  }
+  usb_vendor_cmd = 0;
+  usb_vendor_status.pending = 0;
+}
+
 void bootloader_main ()
 {
   __xdata char buff[100];
   uint8_t ihx_status;
   uint16_t read_start_addr, read_len;
+  uint8_t i;
+  
+  stats_clear();
+  
+  // Before anything might jump to the payload, so the journal is read
+  flash_init();
+  
+  // Whatever is there is left from before the last reset
+  boot_handoff.magic = 0;
   
   if (!want_bootloader())
     jump_to_user();
   
   clock_init();
+  trace_init();
   
   setup_led();
   
-  // Setup timer if enabled
+  // Setup timer if enabled, unless the payload sent us here to be updated.
+  // With no payload to start (none there, or a download the journal shows
+  // was cut short) the timeout would only leave the device stuck.
   #ifdef TIMER
-  setup_timer1();
+  if (!bootloader_requested && check_for_payload())
+    setup_timer1();
   #endif
   
-  usb_init();
+  link_init();
   
   // Enable interrupts
 	EA = 1;
@@ -211,16 +485,25 @@ void bootloader_main ()
     disable_timer1();
     #endif
     
+    // A vendor request came in instead of a record
+    if (buff[0] == 0) {
+      vendor_command();
+      continue;
+    }
+    
+    trace(TRACE_RECORD, ihx_record_type(buff));
     ihx_status = ihx_check_line(buff);
+    trace(TRACE_CHECKED, ihx_status);
     
     if (ihx_status == IHX_OK) {
       switch (ihx_record_type(buff)) {
         case IHX_RECORD_DATA:
+        case IHX_RECORD_RAM_DATA:
           ihx_write(buff);
-          usb_putchar('0');
-          usb_flush();
+          send_status(IHX_OK);
           break;
         case IHX_RECORD_EOF:
+          flash_finish();
           jump_to_user();
           break;
         case IHX_RECORD_RESET:
@@ -228,37 +511,81 @@ void bootloader_main ()
           // erased once, allowing for random writes but preventing overwriting of data already written
           // this session.
           flash_reset();
-          usb_putchar('0');
-          usb_flush();
+          send_status(IHX_OK);
           break;
         case IHX_RECORD_ERASE_ALL:
           // Erase all user flash pages
           flash_erase_all_user();
-          usb_putchar('0');
-          usb_flush();
+          send_status(IHX_OK);
           break;
         case IHX_RECORD_ERASE_PAGE:
           // Erase flash page
           flash_erase_page(ihx_data_byte(buff, 0));
-          usb_putchar('0');
-          usb_flush();
+          send_status(IHX_OK);
+          break;
+        case IHX_RECORD_ERASE_AHEAD:
+          // Start erasing the declared pages in the background
+          flash_erase_ahead(ihx_data_byte(buff, 0), ihx_data_byte(buff, 1));
+          send_status(IHX_OK);
+          break;
+        case IHX_RECORD_ERASE_RANGE:
+          // Erase the pages in range that aren't already blank
+          flash_erase_range(ihx_data_byte(buff, 0), ihx_data_byte(buff, 1));
+          send_status(IHX_OK);
+          break;
+        case IHX_RECORD_PAGE_STATE:
+          // Report page states once everything queued has been written
+          flash_wait();
+          for (i=0; i<FLASH_PAGES; i++)
+            link_putchar(to_hex4_ascii(flash_page_state(i)));
+          link_putchar('\n');
+          link_flush();
+          break;
+        case IHX_RECORD_RAM_RUN:
+          // Acknowledge first and give the host time to pick it up, it won't
+          // hear from us again
+          send_status(IHX_OK);
+          delay(1);
+          jump_to_ram(ihx_record_address(buff));
+          break;
+        case IHX_RECORD_STATUS_MODE:
+          // Answer on the bulk pipe either way, as the host expects
+          usb_status_notify = 0;
+          send_status(IHX_OK);
+          usb_status_notify = ihx_data_byte(buff, 0);
+          break;
+        case IHX_RECORD_SET_SERIAL:
+          send_status(set_serial(buff));
+          break;
+        #ifdef TRACE
+        case IHX_RECORD_TRACE:
+          trace_dump(hex8(&buff[1]) && ihx_data_byte(buff, 0) == 1);
+          break;
+        #endif
+        case IHX_RECORD_STATS:
+          send_stats(hex8(&buff[1]) && ihx_data_byte(buff, 0) == 1);
+          break;
+        case IHX_RECORD_LINKTEST:
+          run_linktest(buff);
+          break;
+        case IHX_RECORD_DEVICE_INFO:
+          send_device_info();
           break;
         case IHX_RECORD_READ:
           // Read out a section of flash over USB
+          flash_wait();
           read_start_addr = ihx_record_address(buff);
           read_len = ihx_data_byte(buff, 0)<<8 + ihx_data_byte(buff, 1);
-          usb_putchar('\n');
+          link_putchar('\n');
           ihx_read_print((__xdata uint8_t*)read_start_addr, read_len);
           break;
         default:
           // Return the error code for unknown type in this case too
-          usb_putchar(IHX_BAD_RECORD_TYPE + '0');
-          usb_flush();
+          send_status(IHX_BAD_RECORD_TYPE);
           break;
       }
     } else {
-      usb_putchar(ihx_status + '0');
-      usb_flush();
+      send_status(ihx_status);
     }
 	}
 }
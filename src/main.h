@@ -20,17 +20,55 @@
 #ifndef _MAIN_H_
 #define _MAIN_H_
 
+// Bootloader version reported by the device info record, major.minor in BCD
+#define BOOTLOADER_VERSION 0x0200
+
 // The address of the start of the user code section
 // This must be a multiple of 1kb to fit on a flash page boundary
 // !!! NOTE: at the moment you must also change this in start.asm IVT !!!
 #define USER_CODE_BASE (5*1024)
 #define USER_FIRST_PAGE (USER_CODE_BASE/1024)
 
+// If TRACE is enabled the bootloader logs timestamped events (records, erases,
+// flash writes, replies) to a ring buffer in RAM, read back with the TRACE
+// record. It times them with Timer 1, so it can't be used together with TIMER.
+//#define TRACE
+#if defined(TRACE) && defined(TIMER)
+#error "TRACE and TIMER both need Timer 1"
+#endif
+
+// Region of RAM that test payloads can be loaded into and run from without
+// touching flash. The CC1111 maps its SRAM into code space at the same
+// addresses as in XDATA. The bootloader's own XRAM sits below RAM_CODE_BASE
+// and the top of SRAM is left for passing flags across a reset.
+#define RAM_CODE_BASE 0xF400
+#ifdef TRACE
+// The trace buffer takes the top of the window, see trace.h
+#define TRACE_ADDR    0xFA00
+#define RAM_CODE_END  TRACE_ADDR
+#else
+#define RAM_CODE_END  0xFE00
+#endif
+
 // Change to match the CC1111 part you are using
 #define FLASH_SIZE 0x8000
 //(32*1024)
 #define FLASH_PAGES (FLASH_SIZE/1024)
 
+// If JOURNAL is enabled the last flash page is reserved for a log of the
+// pages completed during a download. After a power failure the bootloader
+// then knows which pages are good, so the download can be resumed, and it
+// won't start a half written payload.
+//#define JOURNAL
+#ifdef JOURNAL
+#define JOURNAL_PAGE (FLASH_PAGES-1)
+#define USER_LAST_PAGE (JOURNAL_PAGE-1)
+#else
+#define USER_LAST_PAGE (FLASH_PAGES-1)
+#endif
+// The address just past the end of the user code section
+#define USER_CODE_END (((uint16_t)USER_LAST_PAGE+1)*1024)
+
 // If TIMER is enabled then the bootloader will jump to user code after
 // a period of time if there has been no activity on the USB interface.
 //#define TIMER
@@ -38,6 +76,18 @@
 // approximately 43.7 milliseconds.
 #define TIMER_TIMEOUT 229 // 10s timeout
 
+// If WARM_HANDOFF is enabled then the USB link is left up when starting the
+// payload if the host had configured it, and the clock and USB state are
+// described to the payload at HANDOFF_ADDR (see services.h) so it can keep
+// using the link without the host enumerating the device again.
+//#define WARM_HANDOFF
+
+// If UART_LINK is enabled then the bootloader also talks to the host over
+// USART0 (see uart.h for pins and baud rate), for boards where that is all
+// the test fixture can reach. Whichever link a record comes in on gets the
+// reply.
+//#define UART_LINK
+
 // Useful for printf etc. but uses a bunch of code space
 //#define STDIO
 #ifdef STDIO
@@ -47,8 +97,40 @@
  // this is disabled?
 #endif
 
+// The USB serial number can be provisioned once per board into this slot at
+// the end of the bootloader's flash, which the bootloader never erases. Up to
+// SERIAL_MAX_LEN ASCII characters, unused bytes left as 0xFF. If it is blank
+// the serial number in usb.h is used.
+// !!! NOTE: --code-size in the Makefile must stop short of SERIAL_ADDR !!!
+#define SERIAL_ADDR (USER_CODE_BASE-0x30)
+#define SERIAL_MAX_LEN 16
+
+// A payload can ask for the bootloader by storing BOOTLOADER_REQUEST_MAGIC at
+// BOOTLOADER_REQUEST_ADDR and resetting through the watchdog, see
+// enter_bootloader(). RAM survives a watchdog reset and this word is outside
+// everything the bootloader and RAM test code use. The bootloader then skips
+// want_bootloader()'s checks and the TIMER timeout.
+#define BOOTLOADER_REQUEST_ADDR   0xFEFE
+#define BOOTLOADER_REQUEST_MAGIC  0xB007
+#define bootloader_request (*((__xdata volatile uint16_t*)BOOTLOADER_REQUEST_ADDR))
+// Setting the CDC line coding to this baud rate while the payload is running
+// (with the USB link left up) enters the bootloader, like Arduino's 1200 bps
+// touch
+#define BOOTLOADER_TOUCH_RATE 1200
+
+// Optional features reported by the device info record
+#define FEATURE_TIMER       0x01
+#define FEATURE_JOURNAL     0x02
+#define FEATURE_VENDOR_BULK 0x04
+#define FEATURE_WARM_HANDOFF 0x08
+#define FEATURE_VENDOR_REQ  0x10
+#define FEATURE_UART_LINK   0x20
+#define FEATURE_TRACE       0x40
+
 #define nop()	__asm nop __endasm;
 
 extern uint8_t bootloader_running;
 
+void enter_bootloader();
+
 #endif // _MAIN_H_
\ No newline at end of file
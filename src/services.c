@@ -0,0 +1,35 @@
+/*
+ * CC Bootloader - Services exported to the payload
+ *
+ * Fergus Noble (c) 2011
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#define _BOOTLOADER_
+#include "cc1111.h"
+#include "main.h"
+#include "flash.h"
+#include "services.h"
+
+// Entry points for the service table in start.asm. They adapt the drivers to
+// take a single argument where needed.
+
+void svc_flash_erase_page(uint8_t page) {
+  flash_erase_page(page);
+}
+
+void svc_flash_write(__xdata struct svc_flash_write_args *args) {
+  flash_write((__xdata uint16_t*)args->buff, args->len, args->addr);
+}
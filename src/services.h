@@ -0,0 +1,104 @@
+/*
+ * CC Bootloader - Services exported to the payload
+ *
+ * Fergus Noble (c) 2011
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#ifndef _SERVICES_H_
+#define _SERVICES_H_
+
+// The bootloader keeps a table of jumps to some of its drivers at a fixed
+// address just below USER_CODE_BASE so a payload can use them rather than
+// carrying its own copies. Every service takes at most one argument, passed
+// in DPL/DPH like any sdcc function, so the table doesn't depend on how the
+// bootloader was compiled.
+//
+// The services run on the bootloader's own RAM. A payload using them must
+// leave the bootloader's XRAM alone (link with --xram-loc 0xf300) and keep
+// its internal RAM variables clear of the bootloader's data segment, which
+// the services use as scratch space (see CCBootloader.mem, link with
+// --data-loc past it). Anything the services keep between calls lives in
+// XRAM, because the payload's startup code clears all of internal RAM.
+//
+// The USB services only work if the USB link was left up for the payload.
+//
+// !!! NOTE: SERVICE_TABLE is hardcoded in src/start.asm and the bootloader's
+// --code-size in the Makefile must stop short of it !!!
+
+#define SERVICE_TABLE (USER_CODE_BASE-0x20)
+#define SERVICES_VERSION 0x0002
+
+// Arguments for svc_flash_write
+struct svc_flash_write_args {
+  uint16_t  buff;   // XRAM address of the data to write
+  uint16_t  len;    // Number of 16-bit words to write
+  uint16_t  addr;   // Flash address to write to, must be even
+};
+
+// With WARM_HANDOFF the bootloader leaves the clock running and a configured
+// USB link up when it starts the payload, and describes them here. The payload
+// can then skip clock_init() and carry on using the USB services without the
+// host re-enumerating the device: check magic, then re-enable the USB
+// interrupt (IEN2_USBIE) and EA. Don't touch the D+ pull-up (P1_0).
+//
+// While magic is set the USB interrupt goes to the bootloader's handler, not
+// the payload's vector, so EP0 keeps being answered. A payload that wants the
+// USB interrupt for itself clears magic first, and can't use the USB services
+// after that.
+// !!! NOTE: HANDOFF_ADDR and HANDOFF_MAGIC are hardcoded in src/start.asm !!!
+#define HANDOFF_ADDR    0xFEF0
+#define HANDOFF_MAGIC   0x4B57
+#define HANDOFF_VERSION 0x01
+
+struct boot_handoff {
+  uint16_t  magic;              // HANDOFF_MAGIC if the link was left up
+  uint8_t   version;            // HANDOFF_VERSION
+  uint8_t   clkcon;             // CLKCON as set by the bootloader
+  uint8_t   usb_address;        // Address assigned by the host
+  uint8_t   usb_configuration;  // Active configuration
+  uint8_t   features;           // Bootloader build options, FEATURE_* in main.h
+};
+
+#define boot_handoff (*((__xdata volatile struct boot_handoff*)HANDOFF_ADDR))
+
+#ifndef _BOOTLOADER_
+
+#ifndef USER_CODE_BASE
+#define USER_CODE_BASE 0x1400
+#endif
+
+// Erase a flash page, waiting for it to complete. Bootloader pages are left alone.
+#define svc_flash_erase_page ((void (*)(uint8_t))(SERVICE_TABLE + 0x00))
+// Write to flash by DMA, waiting for it to complete. The page must already be erased.
+#define svc_flash_write ((void (*)(__xdata struct svc_flash_write_args *))(SERVICE_TABLE + 0x03))
+// USB CDC serial port
+#define svc_usb_putchar ((void (*)(char))(SERVICE_TABLE + 0x06))
+#define svc_usb_getchar ((char (*)(void))(SERVICE_TABLE + 0x09))
+#define svc_usb_pollchar ((char (*)(void))(SERVICE_TABLE + 0x0C))
+#define svc_usb_flush ((void (*)(void))(SERVICE_TABLE + 0x0F))
+// Reset into the bootloader for an update, doesn't return (version 0x0002)
+#define svc_enter_bootloader ((void (*)(void))(SERVICE_TABLE + 0x12))
+// Version of the service table, read with a MOVC or through XDATA
+#define svc_version (*(__code uint16_t *)(SERVICE_TABLE + 0x1E))
+
+#else
+
+void svc_flash_erase_page(uint8_t page);
+void svc_flash_write(__xdata struct svc_flash_write_args *args);
+
+#endif // _BOOTLOADER_
+
+#endif // _SERVICES_H_
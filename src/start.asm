@@ -0,0 +1,133 @@
+	.globl __start__stack
+;--------------------------------------------------------
+; Stack segment in internal ram
+;--------------------------------------------------------
+	.area	SSEG	(DATA)
+__start__stack:
+	.ds	1
+
+;--------------------------------------------------------
+; interrupt vector 
+;--------------------------------------------------------
+	.area VECTOR    (CODE)
+	.globl __interrupt_vect
+__interrupt_vect:
+	ljmp	__sdcc_gsinit_startup
+	
+	ljmp #(0x1400+0x03)
+	.ds	5
+	ljmp #(0x1400+0x0B)
+	.ds	5
+	ljmp #(0x1400+0x13)
+	.ds	5
+	ljmp #(0x1400+0x1B)
+	.ds	5
+	ljmp #(0x1400+0x23)
+	.ds 5
+	ljmp #(0x1400+0x2B)
+	.ds	5
+	ljmp usb_isr_forward
+	.ds	5
+	ljmp #(0x1400+0x3B)
+	.ds	5
+	ljmp _dma_isr_forward ; defined in main.c
+	.ds	5
+	ljmp _timer1_isr_forward ; defined in main.c
+	.ds	5
+	ljmp #(0x1400+0x53)
+	.ds	5
+	ljmp #(0x1400+0x5B)
+	.ds	5
+	ljmp #(0x1400+0x63)
+	.ds	5
+	ljmp #(0x1400+0x6B)
+	.ds	5
+	ljmp #(0x1400+0x73)
+	.ds	5
+	ljmp #(0x1400+0x7B)
+	.ds	5
+	ljmp #(0x1400+0x83)
+	.ds	5
+	ljmp #(0x1400+0x8B)
+	.ds	5
+	
+usb_isr_forward:
+	push acc
+	mov	a, _bootloader_running
+	jnz	usb_isr_forward_bootloader
+	; A payload the USB link was handed over to keeps the bootloader ISR,
+	; boot_handoff.magic reads HANDOFF_MAGIC (0x4B57 at 0xFEF0, services.h)
+	push	dpl
+	push	dph
+	mov	dptr, #0xFEF0
+	movx	a, @dptr
+	xrl	a, #0x57
+	jnz	usb_isr_forward_check
+	inc	dptr
+	movx	a, @dptr
+	xrl	a, #0x4B
+usb_isr_forward_check:
+	pop	dph
+	pop	dpl
+	jz	usb_isr_forward_bootloader
+	; Bootloader not running, jump into the payload ISR
+	pop acc
+	ljmp #(0x1400+0x33)
+usb_isr_forward_bootloader:
+	pop acc
+	ljmp	_usb_isr
+	
+;--------------------------------------------------------
+; external initialized ram data
+;--------------------------------------------------------
+	.area XISEG   (XDATA)
+	.area HOME    (CODE)
+	.area GSINIT0 (CODE)
+	.area GSINIT1 (CODE)
+	.area GSINIT2 (CODE)
+	.area GSINIT3 (CODE)
+	.area GSINIT4 (CODE)
+	.area GSINIT5 (CODE)
+	.area GSINIT  (CODE)
+	.area GSFINAL (CODE)
+	.area CSEG    (CODE)
+
+;--------------------------------------------------------
+; global & static initialisations
+;--------------------------------------------------------
+	
+	.area GSINIT  (CODE)
+	.globl __sdcc_gsinit_startup
+	.globl __sdcc_program_startup
+	.globl __start__stack
+	.globl __mcs51_genXINIT
+	.globl __mcs51_genXRAMCLEAR
+	.globl __mcs51_genRAMCLEAR
+	.area GSFINAL (CODE)
+	.globl __sdcc_program_startup
+	ljmp	__sdcc_program_startup
+;--------------------------------------------------------
+; Home
+;--------------------------------------------------------
+	.area HOME    (CODE)
+	.area HOME    (CODE)
+__sdcc_program_startup:
+	lcall	_bootloader_main
+	;	return from main will lock up
+	sjmp .
+
+;--------------------------------------------------------
+; Service table for the payload, see src/services.h
+; Must sit at SERVICE_TABLE (USER_CODE_BASE-0x20)
+;--------------------------------------------------------
+	.area SVCTAB (ABS,CODE)
+	.org	0x13E0
+	ljmp	_svc_flash_erase_page
+	ljmp	_svc_flash_write
+	ljmp	_usb_putchar
+	ljmp	_usb_getchar
+	ljmp	_usb_pollchar
+	ljmp	_usb_flush
+	ljmp	_enter_bootloader
+	.org	0x13FE
+	.dw	0x0002	; SERVICES_VERSION
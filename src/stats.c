@@ -0,0 +1,41 @@
+/*
+ * CC Bootloader - Performance counters
+ *
+ * Fergus Noble (c) 2011
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#include "cc1111.h"
+#include "stats.h"
+#include "xmem.h"
+
+__xdata struct boot_stats stats;
+
+uint32_t stats_now() {
+  uint32_t t;
+  t = ST0;
+  t |= (uint16_t)ST1 << 8;
+  t |= (uint32_t)ST2 << 16;
+  return t;
+}
+
+uint32_t stats_since(uint32_t start) {
+  return (stats_now() - start) & 0xFFFFFF;
+}
+
+void stats_clear() {
+  xmem_set((__xdata uint8_t*)&stats, 0, sizeof(stats));
+  stats.start = stats_now();
+}
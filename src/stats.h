@@ -0,0 +1,46 @@
+/*
+ * CC Bootloader - Performance counters
+ *
+ * Fergus Noble (c) 2011
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+// Counters showing where a session's time goes, reported by
+// IHX_RECORD_STATS. Times are in sleep timer ticks, which run from the 32 kHz
+// RC oscillator (nominally 1/32000 s).
+struct boot_stats {
+  uint16_t  records;            // Records answered
+  uint16_t  errors[5];          // Records rejected, by result code 1-5
+  uint16_t  erases;             // Flash pages erased
+  uint16_t  writes;             // Flash DMA writes
+  uint16_t  usb_out_packets;    // USB packets received from the host
+  uint16_t  usb_in_packets;     // USB packets sent to the host
+  uint32_t  flash_wait_ticks;   // Time blocked waiting for the flash
+  uint32_t  host_wait_ticks;    // Time idle waiting for the host
+  uint32_t  start;              // When the counters were cleared
+};
+
+extern __xdata struct boot_stats stats;
+
+// Current sleep timer count, 24 bits
+uint32_t stats_now();
+// Ticks since a stats_now() reading, allowing for the count wrapping
+uint32_t stats_since(uint32_t start);
+void stats_clear();
+
+#endif // _STATS_H_
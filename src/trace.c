@@ -0,0 +1,95 @@
+/*
+ * CC Bootloader - Event trace
+ *
+ * Fergus Noble (c) 2011
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#include "cc1111.h"
+#include "main.h"
+#include "intel_hex.h"
+#include "link.h"
+#include "trace.h"
+
+#ifdef TRACE
+
+#define trace_buff ((__xdata struct trace_entry *)TRACE_ADDR)
+
+// Next entry to write, and whether the buffer has wrapped
+static uint8_t trace_pos;
+static uint8_t trace_full;
+
+void trace_init() {
+  trace_pos = 0;
+  trace_full = 0;
+  // Free running at the timer tick
+  T1CTL = T1CTL_DIV_1 | T1CTL_MODE_FREE;
+}
+
+// Called from the DMA ISR as well
+void trace(uint8_t event, uint8_t arg) __reentrant {
+  __xdata struct trace_entry *e;
+  __critical {
+    e = &trace_buff[trace_pos];
+    e->time_l = T1CNTL;
+    e->time_h = T1CNTH;
+    e->event = event;
+    e->arg = arg;
+    if (++trace_pos == 0)
+      trace_full = 1;
+  }
+}
+
+void trace_dump(uint8_t clear) {
+  // Reply to IHX_RECORD_TRACE, oldest entry first, 8 to a line
+  __xdata char buff[8*8+2];
+  __xdata struct trace_entry *e;
+  uint16_t left;
+  uint8_t pos, i;
+
+  if (trace_full) {
+    pos = trace_pos;
+    left = TRACE_LEN;
+  } else {
+    pos = 0;
+    left = trace_pos;
+  }
+
+  i = 0;
+  while (left) {
+    e = &trace_buff[pos++];
+    to_hex8_ascii(&buff[i], e->event);
+    to_hex8_ascii(&buff[i+2], e->arg);
+    to_hex8_ascii(&buff[i+4], e->time_h);
+    to_hex8_ascii(&buff[i+6], e->time_l);
+    i += 8;
+    left--;
+    if (i == 8*8 || left == 0) {
+      buff[i] = '\n';
+      buff[i+1] = 0;
+      link_putstr(buff);
+      i = 0;
+    }
+  }
+  // An empty line marks the end
+  link_putstr("\n");
+
+  if (clear) {
+    trace_pos = 0;
+    trace_full = 0;
+  }
+}
+
+#endif // TRACE
@@ -0,0 +1,61 @@
+/*
+ * CC Bootloader - Event trace
+ *
+ * Fergus Noble (c) 2011
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+// With TRACE (main.h) events are logged to a ring buffer of TRACE_LEN entries
+// at TRACE_ADDR, overwriting the oldest. Each entry is 4 bytes: the event,
+// an argument and the Timer 1 count (big endian) when it happened. Timer 1
+// runs free at the 187.5 kHz timer tick, so the count goes up every 5.33 us
+// and wraps every 350 ms.
+
+#define TRACE_LEN 256
+
+// Events and their arguments
+#define TRACE_IDLE         0x01  // Started waiting for the host
+#define TRACE_RECORD       0x02  // Record received, record type
+#define TRACE_CHECKED      0x03  // Record checked, result code
+#define TRACE_ACK          0x04  // Result sent, result code
+#define TRACE_ERASE_START  0x05  // Page erase started, page
+#define TRACE_ERASE_END    0x06  // Page erase finished
+#define TRACE_DMA_START    0x07  // Flash write started, page
+#define TRACE_DMA_END      0x08  // Flash write finished
+
+#ifdef TRACE
+
+struct trace_entry {
+  uint8_t   event;
+  uint8_t   arg;
+  uint8_t   time_h;
+  uint8_t   time_l;
+};
+
+void trace_init();
+void trace(uint8_t event, uint8_t arg) __reentrant;
+void trace_dump(uint8_t clear);
+
+#else
+
+#define trace_init()
+#define trace(event, arg)
+
+#endif // TRACE
+
+#endif // _TRACE_H_
@@ -0,0 +1,148 @@
+/*
+ * CC Bootloader - USART0 serial driver
+ *
+ * Fergus Noble (c) 2011
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#include "cc1111.h"
+#include "main.h"
+#include "hal.h"
+#include "uart.h"
+#include "xmem.h"
+
+#ifdef UART_LINK
+
+// DMA channel 1 copies received bytes round rx_buff and channel 2 feeds the
+// transmitter from tx_buff. DMA1CFG points at the descriptor for channel 1,
+// the one for channel 2 must follow it.
+static __xdata struct cc_dma_channel uart_dma[2];
+static __xdata uint8_t uart_rx_buff[UART_RX_SIZE];
+static __xdata uint8_t uart_tx_buff[UART_TX_SIZE];
+static uint8_t uart_rx_pos;
+static uint8_t uart_tx_len;
+
+void uart_init()
+{
+  uart_pins_init();
+
+  // 8N1, no flow control
+  U0CSR = UxCSR_MODE_UART;
+  U0UCR = UxUCR_FLUSH | UxUCR_FLOW_DISABLE | UxUCR_BIT9_8_BITS |
+          UxUCR_PARITY_DISABLE | UxUCR_SPB_1_STOP_BIT | UxUCR_STOP_HIGH |
+          UxUCR_START_LOW;
+  U0BAUD = UART_BAUD_M;
+  U0GCR = UxGCR_ORDER_LSB | UART_BAUD_E;
+
+  // Nothing the host sends is ever zero, so a zero in the ring buffer marks
+  // where the DMA hasn't written yet
+  xmem_set(uart_rx_buff, 0, UART_RX_SIZE);
+  uart_rx_pos = 0;
+  uart_tx_len = 0;
+
+  // Receive, one byte per URX0 trigger round the ring buffer forever
+  uart_dma[0].src_high = ((uint16_t)&U0DBUFXADDR >> 8) & 0x00FF;
+  uart_dma[0].src_low  = (uint16_t)&U0DBUFXADDR & 0x00FF;
+  uart_dma[0].dst_high = ((uint16_t)uart_rx_buff >> 8) & 0x00FF;
+  uart_dma[0].dst_low  = (uint16_t)uart_rx_buff & 0x00FF;
+  uart_dma[0].len_high = DMA_LEN_HIGH_VLEN_LEN;
+  uart_dma[0].len_low  = UART_RX_SIZE;
+  uart_dma[0].cfg0 = \
+    DMA_CFG0_WORDSIZE_8 | \
+    DMA_CFG0_TMODE_REPEATED_SINGLE | \
+    DMA_CFG0_TRIGGER_URX0;
+  uart_dma[0].cfg1 = \
+    DMA_CFG1_SRCINC_0 | \
+    DMA_CFG1_DESTINC_1 | \
+    DMA_CFG1_PRIORITY_HIGH;
+
+  // Transmit, one byte per UTX0 trigger, length set by uart_flush()
+  uart_dma[1].src_high = ((uint16_t)uart_tx_buff >> 8) & 0x00FF;
+  uart_dma[1].src_low  = (uint16_t)uart_tx_buff & 0x00FF;
+  uart_dma[1].dst_high = ((uint16_t)&U0DBUFXADDR >> 8) & 0x00FF;
+  uart_dma[1].dst_low  = (uint16_t)&U0DBUFXADDR & 0x00FF;
+  uart_dma[1].len_high = DMA_LEN_HIGH_VLEN_LEN;
+  uart_dma[1].cfg0 = \
+    DMA_CFG0_WORDSIZE_8 | \
+    DMA_CFG0_TMODE_SINGLE | \
+    DMA_CFG0_TRIGGER_UTX0;
+  uart_dma[1].cfg1 = \
+    DMA_CFG1_SRCINC_1 | \
+    DMA_CFG1_DESTINC_0 | \
+    DMA_CFG1_PRIORITY_NORMAL;
+
+  DMA1CFGH = ((uint16_t)uart_dma >> 8) & 0x00FF;
+  DMA1CFGL = (uint16_t)uart_dma & 0x00FF;
+
+  DMAARM |= DMAARM_DMAARM1;
+  U0CSR |= UxCSR_RE;
+}
+
+void uart_disable()
+{
+  // Stop the DMA before it writes over the payload's RAM
+  U0CSR = UxCSR_MODE_UART;
+  DMAARM = DMAARM_ABORT | DMAARM_DMAARM1 | DMAARM_DMAARM2;
+}
+
+char uart_pollchar()
+{
+  char c = uart_rx_buff[uart_rx_pos];
+  if (c == 0)
+    return UART_READ_AGAIN;
+  uart_rx_buff[uart_rx_pos] = 0;
+  uart_rx_pos = (uart_rx_pos + 1) & (UART_RX_SIZE-1);
+  return c;
+}
+
+// Wait for the last transfer to be done with tx_buff
+static void uart_tx_wait()
+{
+  while (DMAARM & DMAARM_DMAARM2) {}
+}
+
+void uart_flush()
+{
+  if (uart_tx_len == 0)
+    return;
+
+  uart_dma[1].len_low = uart_tx_len;
+  DMAARM |= DMAARM_DMAARM2;
+  // The channel needs a few cycles after arming
+  nop();
+  nop();
+  nop();
+  nop();
+  nop();
+  nop();
+  nop();
+  nop();
+  nop();
+  // The transmitter is idle so nothing would trigger the first byte, start
+  // it by hand
+  DMAREQ |= DMAREQ_DMAREQ2;
+  uart_tx_len = 0;
+}
+
+void uart_putchar(char c)
+{
+  if (uart_tx_len == 0)
+    uart_tx_wait();
+  uart_tx_buff[uart_tx_len++] = c;
+  if (uart_tx_len == UART_TX_SIZE)
+    uart_flush();
+}
+
+#endif // UART_LINK
@@ -0,0 +1,52 @@
+/*
+ * CC Bootloader - USART0 serial driver
+ *
+ * Fergus Noble (c) 2011
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#ifndef _UART_H_
+#define _UART_H_
+
+// USART0 as a link to the host, see UART_LINK in main.h. Both directions run
+// on DMA so bytes keep arriving while the CPU is stalled by flash erases and
+// writes. Uses DMA channels 1 (receive) and 2 (transmit), and the USART0 pins
+// set up in hal.c.
+
+void uart_init();
+void uart_disable();
+char uart_pollchar();
+void uart_putchar(char c);
+void uart_flush();
+
+#define UART_READ_AGAIN ((char) -1)
+
+// Baud rate = (256 + UART_BAUD_M) * 2^UART_BAUD_E / 2^28 * 24 MHz
+// 1 Mbaud (-0.1%), which most USB serial adaptors can do
+#define UART_BAUD_M 85
+#define UART_BAUD_E 15
+// 115200 baud (+0.14%)
+//#define UART_BAUD_M 59
+//#define UART_BAUD_E 12
+
+// Received bytes are kept in a ring buffer, the host mustn't get further
+// ahead of the bootloader than this (a window of 2 records at 16 bytes a
+// record). Must be a power of two.
+#define UART_RX_SIZE 128
+// Bytes to send are collected and sent as one DMA transfer on a flush or when
+// this many have built up
+#define UART_TX_SIZE 64
+
+#endif // _UART_H_
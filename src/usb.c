@@ -19,20 +19,45 @@
  */
 
 #include "cc1111.h"
+#include "main.h"
 #include "usb.h"
+#include "stats.h"
+#include "xmem.h"
 
+// The driver state stays in XRAM, the USB services run it for the payload
+// after a warm handoff and a payload's startup code clears all of IRAM.
 static __xdata uint16_t usb_in_bytes;
 static __xdata uint16_t usb_in_bytes_last;
 static __xdata uint16_t usb_out_bytes;
 volatile static __xdata uint8_t  usb_iif;
 static __xdata uint8_t  usb_running;
+static __xdata uint8_t  usb_status_seq;
+__xdata uint8_t usb_status_notify = 0;
+
+__xdata struct usb_vendor_status usb_vendor_status = {0, '0', 0xFF, 0};
+volatile __xdata uint8_t usb_vendor_cmd = 0;
+__xdata uint8_t usb_vendor_arg[2];
+
+#ifdef USB_VENDOR_BULK
+// Bulk endpoints currently in use, replies go back to the interface the last
+// data came in on
+static __xdata uint8_t  usb_in_ep = USB_IN_EP;
+static __xdata uint8_t  usb_out_ep = USB_OUT_EP;
+#define USB_OUT_EP_MASK ((1 << USB_OUT_EP) | (1 << USB_VENDOR_OUT_EP))
+#define USB_IN_EP_MASK  ((1 << USB_IN_EP) | (1 << USB_VENDOR_IN_EP))
+#else
+#define usb_in_ep       USB_IN_EP
+#define usb_out_ep      USB_OUT_EP
+#define USB_OUT_EP_MASK (1 << USB_OUT_EP)
+#define USB_IN_EP_MASK  (1 << USB_IN_EP)
+#endif
 
 static void usb_set_interrupts()
 {
   // IN interrupts on the control an IN endpoints
-  USBIIE = (1 << USB_CONTROL_EP) | (1 << USB_IN_EP);
-  // OUT interrupts on the OUT endpoint
-  USBOIE = (1 << USB_OUT_EP);
+  USBIIE = (1 << USB_CONTROL_EP) | USB_IN_EP_MASK;
+  // OUT interrupts on the OUT endpoints
+  USBOIE = USB_OUT_EP_MASK;
   // Only care about reset
   USBCIE = USBCIE_RSTIE;
 }
@@ -46,7 +71,8 @@ struct usb_setup {
 } __xdata usb_setup;
 
 __xdata uint8_t usb_ep0_state;
-uint8_t * __xdata usb_ep0_in_data;
+// Descriptors are read out of flash through its XDATA mapping
+__xdata uint8_t * __xdata usb_ep0_in_data;
 __xdata uint8_t usb_ep0_in_len;
 __xdata uint8_t usb_ep0_in_buf[2];
 __xdata uint8_t usb_ep0_out_len;
@@ -74,14 +100,30 @@ static void usb_ep0_flush()
     usb_ep0_state = USB_EP0_IDLE;
   }
   usb_ep0_in_len -= this_len;
-  while (this_len--)
-    USBFIFO[0] = *usb_ep0_in_data++;
+  xmem_to_fifo(&USBFIFO[0], usb_ep0_in_data, this_len);
+  usb_ep0_in_data += this_len;
   USBINDEX = 0;
   USBCS0 = cs0;
 }
 
 __xdata static struct usb_line_coding usb_line_coding = {115200, 0, 0, 8};
 
+// iSerial descriptor built from the provisioned serial number, see main.h
+static __xdata uint8_t usb_serial_desc[2 + 2*SERIAL_MAX_LEN];
+
+void usb_serial_init()
+{
+  __xdata uint8_t *serial = (__xdata uint8_t *) SERIAL_ADDR;
+  uint8_t i;
+
+  for (i = 0; i < SERIAL_MAX_LEN && serial[i] != 0xFF; i++) {
+    usb_serial_desc[2 + 2*i] = serial[i];
+    usb_serial_desc[3 + 2*i] = 0;
+  }
+  usb_serial_desc[0] = 2 + 2*i;
+  usb_serial_desc[1] = USB_DESC_STRING;
+}
+
 // Walk through the list of descriptors and find a match
 static void usb_get_descriptor(uint16_t value)
 {
@@ -89,6 +131,14 @@ static void usb_get_descriptor(uint16_t value)
   __xdata uint8_t   type = value >> 8;
   __xdata uint8_t   index = value;
 
+  // A provisioned serial number replaces the built in one
+  if (type == USB_DESC_STRING && index == USB_iSerial_INDEX &&
+      usb_serial_desc[0] > 2) {
+    usb_ep0_in_len = usb_serial_desc[0];
+    usb_ep0_in_data = usb_serial_desc;
+    return;
+  }
+
   descriptor = usb_descriptors;
   while (descriptor[0] != 0) {
     if (descriptor[1] == type && index-- == 0) {
@@ -96,7 +146,7 @@ static void usb_get_descriptor(uint16_t value)
         usb_ep0_in_len = descriptor[2];
       else
         usb_ep0_in_len = descriptor[0];
-      usb_ep0_in_data = descriptor;
+      usb_ep0_in_data = (__xdata uint8_t *)(uint16_t) descriptor;
       break;
     }
     descriptor += descriptor[0];
@@ -113,8 +163,8 @@ static void usb_ep0_fill()
   if (len > usb_ep0_out_len)
     len = usb_ep0_out_len;
   usb_ep0_out_len -= len;
-  while (len--)
-    *usb_ep0_out_data++ = USBFIFO[0];
+  xmem_from_fifo(usb_ep0_out_data, &USBFIFO[0], len);
+  usb_ep0_out_data += len;
 }
 
 void usb_ep0_queue_byte (uint8_t a)
@@ -131,15 +181,36 @@ void usb_set_address (uint8_t address)
 
 static void usb_set_configuration()
 {
+  // Interrupt endpoint for status notifications
+  USBINDEX = USB_INT_EP;
+  USBMAXI = USB_INT_SIZE >> 3;
+  usb_status_seq = 0;
+  usb_status_notify = 0;
+
   // Set the IN max packet size, double buffered
   USBINDEX = USB_IN_EP;
   USBMAXI = USB_IN_SIZE >> 3;
+#ifndef USB_VENDOR_BULK
   USBCSIH |= USBCSIH_IN_DBL_BUF;
+#endif
+  // (EP2's FIFO only has room for a single 64 byte packet, so the CDC IN
+  // endpoint can't be double buffered when the vendor interface is enabled)
 
   // Set the OUT max packet size, double buffered
   USBINDEX = USB_OUT_EP;
   USBMAXO = USB_OUT_SIZE >> 3;
   USBCSOH = USBCSOH_OUT_DBL_BUF;
+
+#ifdef USB_VENDOR_BULK
+  // Vendor interface IN and OUT, both double buffered
+  USBINDEX = USB_VENDOR_IN_EP;
+  USBMAXI = USB_VENDOR_IN_SIZE >> 3;
+  USBCSIH |= USBCSIH_IN_DBL_BUF;
+
+  USBINDEX = USB_VENDOR_OUT_EP;
+  USBMAXO = USB_VENDOR_OUT_SIZE >> 3;
+  USBCSOH = USBCSOH_OUT_DBL_BUF;
+#endif
 }
 
 static void usb_ep0_setup()
@@ -227,12 +298,29 @@ static void usb_ep0_setup()
           break;
         case GET_LINE_CODING:
           usb_ep0_in_len = 7;
-          usb_ep0_in_data = (uint8_t *) &usb_line_coding;
+          usb_ep0_in_data = (__xdata uint8_t *) &usb_line_coding;
           break;
         case SET_CONTROL_LINE_STATE:
           break;
       }
       break;
+    case USB_TYPE_VENDOR:
+      switch (usb_setup.request) {
+        case VENDOR_REQ_STATUS:
+          usb_ep0_in_len = sizeof(usb_vendor_status);
+          usb_ep0_in_data = (__xdata uint8_t *) &usb_vendor_status;
+          break;
+        case VENDOR_REQ_ABORT:
+        case VENDOR_REQ_ERASE_RANGE:
+        case VENDOR_REQ_RUN:
+          // Leave it for the main loop, see ihx_readline()
+          usb_vendor_arg[0] = usb_setup.value;
+          usb_vendor_arg[1] = usb_setup.index;
+          usb_vendor_status.pending = usb_setup.request;
+          usb_vendor_cmd = usb_setup.request;
+          break;
+      }
+      break;
   }
   if (usb_ep0_state != USB_EP0_DATA_OUT) {
     if (usb_setup.length < usb_ep0_in_len)
@@ -281,6 +369,11 @@ static void usb_ep0()
             USBCS0 = USBCS0_CLR_OUTPKT_RDY | USBCS0_DATA_END;
           else
             USBCS0 = USBCS0_CLR_OUTPKT_RDY;
+          // SET_LINE_CODING is our only OUT data stage, acknowledged above
+          // so the host's request completes before we drop off the bus
+          if (usb_ep0_state == USB_EP0_IDLE && !bootloader_running &&
+              usb_line_coding.rate == BOOTLOADER_TOUCH_RATE)
+            enter_bootloader();
           break;
       }
     }
@@ -295,26 +388,30 @@ void usb_isr() __interrupt 6
   usb_iif |= USBIIF;
   usb_ep0();
 
-  if (USBCIF & USBCIF_RSTIF)
+  if (USBCIF & USBCIF_RSTIF) {
+    // A new host session, it will want its results on the bulk pipe
+    usb_status_notify = 0;
     usb_set_interrupts();
+  }
 }
 
 // Wait for a free IN buffer
 static void usb_in_wait()
 {
   while (1) {
-    USBINDEX = USB_IN_EP;
+    USBINDEX = usb_in_ep;
     if ((USBCSIL & USBCSIL_INPKT_RDY) == 0)
       break;
-    while (!(usb_iif & (1 << USB_IN_EP))) {}
+    while (!(usb_iif & (1 << usb_in_ep))) {}
   }
 }
 
 // Send the current IN packet
 static void usb_in_send()
 {
-  USBINDEX = USB_IN_EP;
+  USBINDEX = usb_in_ep;
   USBCSIL |= USBCSIL_INPKT_RDY;
+  stats.usb_in_packets++;
   usb_in_bytes_last = usb_in_bytes;
   usb_in_bytes = 0;
 }
@@ -332,6 +429,38 @@ void usb_flush()
   }
 }
 
+// Send a record result on the interrupt endpoint, see USB_NOTIFY_STATUS.
+// Returns 0 if it couldn't, leaving notifications turned off.
+uint8_t usb_notify_status(uint8_t status, uint8_t page)
+{
+  uint32_t start = stats_now();
+
+  // Wait for the host to collect the last one. If nothing is reading the
+  // interrupt endpoint any more the host that asked for them has gone.
+  while (1) {
+    if (!usb_running || !usb_status_notify ||
+        stats_since(start) > USB_NOTIFY_TIMEOUT) {
+      usb_status_notify = 0;
+      return 0;
+    }
+    USBINDEX = USB_INT_EP;
+    if ((USBCSIL & USBCSIL_INPKT_RDY) == 0)
+      break;
+  }
+
+  USBFIFO[USB_INT_EP << 1] = 0xA1;
+  USBFIFO[USB_INT_EP << 1] = USB_NOTIFY_STATUS;
+  USBFIFO[USB_INT_EP << 1] = status;
+  USBFIFO[USB_INT_EP << 1] = usb_status_seq++;
+  USBFIFO[USB_INT_EP << 1] = 0;
+  USBFIFO[USB_INT_EP << 1] = page;
+  USBFIFO[USB_INT_EP << 1] = 0;
+  USBFIFO[USB_INT_EP << 1] = 0;
+  USBINDEX = USB_INT_EP;
+  USBCSIL |= USBCSIL_INPKT_RDY;
+  return 1;
+}
+
 void usb_putchar(char c) __reentrant
 {
   if (!usb_running)
@@ -340,40 +469,172 @@ void usb_putchar(char c) __reentrant
   usb_in_wait();
 
   // Queue a byte, sending the packet when full
-  USBFIFO[USB_IN_EP << 1] = c;
+  USBFIFO[usb_in_ep << 1] = c;
   if (++usb_in_bytes == USB_IN_SIZE)
     usb_in_send();
 }
 
-char usb_pollchar()
+// Move len bytes of raw bulk data for IHX_RECORD_LINKTEST. This works a whole
+// packet at a time straight on the FIFOs, so it shows what the link itself
+// can do without the record handling. A vendor ABORT request stops it early,
+// as does the host going quiet for USB_LINKTEST_IDLE. Returns the number of
+// bytes it didn't get to.
+uint32_t usb_linktest(uint8_t mode, uint32_t len)
+{
+  uint8_t n, i;
+  uint32_t last = stats_now();
+  
+  usb_flush();
+  while (len && usb_running && usb_vendor_cmd != VENDOR_REQ_ABORT) {
+    if (mode == USB_LINKTEST_SOURCE) {
+      USBINDEX = usb_in_ep;
+      if (USBCSIL & USBCSIL_INPKT_RDY) {
+        if (stats_since(last) > USB_LINKTEST_IDLE)
+          break;
+        continue;
+      }
+      n = (len < USB_IN_SIZE) ? len : USB_IN_SIZE;
+      for (i=0; i<n; i++)
+        USBFIFO[usb_in_ep << 1] = i;
+      usb_in_bytes = n;
+      usb_in_send();
+    } else {
+      USBINDEX = usb_out_ep;
+      if ((USBCSOL & USBCSOL_OUTPKT_RDY) == 0) {
+        // Don't take the next session's records for test data
+        if (stats_since(last) > USB_LINKTEST_IDLE)
+          break;
+        continue;
+      }
+      n = USBCNTL;
+      stats.usb_out_packets++;
+      if (mode == USB_LINKTEST_ECHO) {
+        // Straight back from one FIFO into the other
+        usb_in_wait();
+        for (i=0; i<n; i++)
+          USBFIFO[usb_in_ep << 1] = USBFIFO[usb_out_ep << 1];
+        usb_in_bytes = n;
+        usb_in_send();
+      }
+      // Sunk data is dropped with the packet, there's no need to read it
+      USBINDEX = usb_out_ep;
+      USBCSOL &= ~USBCSOL_OUTPKT_RDY;
+    }
+    len = (n < len) ? len - n : 0;
+    last = stats_now();
+  }
+  // Don't leave a full last packet without its end marker
+  usb_flush();
+  return len;
+}
+
+#ifdef USB_VENDOR_BULK
+// Switch over to the other interface if the current one has nothing waiting
+// but the other one does
+static void usb_select_ep()
+{
+  uint8_t other_out_ep;
+  
+  USBINDEX = usb_out_ep;
+  if (USBCSOL & USBCSOL_OUTPKT_RDY)
+    return;
+  
+  other_out_ep = (usb_out_ep == USB_OUT_EP) ? USB_VENDOR_OUT_EP : USB_OUT_EP;
+  USBINDEX = other_out_ep;
+  if ((USBCSOL & USBCSOL_OUTPKT_RDY) == 0)
+    return;
+  
+  // Don't leave a partial reply behind on the old interface
+  usb_flush();
+  usb_out_ep = other_out_ep;
+  usb_in_ep = (other_out_ep == USB_OUT_EP) ? USB_IN_EP : USB_VENDOR_IN_EP;
+  usb_in_bytes_last = 0;
+}
+#endif
+
+// Make sure there is an OUT packet with data left in it, returns 0 if the
+// host hasn't sent any
+static uint8_t usb_out_ready()
 {
-  char c;
   if (usb_out_bytes == 0) {
-    USBINDEX = USB_OUT_EP;
+#ifdef USB_VENDOR_BULK
+    usb_select_ep();
+#endif
+    USBINDEX = usb_out_ep;
     if ((USBCSOL & USBCSOL_OUTPKT_RDY) == 0)
-      return USB_READ_AGAIN;
+      return 0;
     usb_out_bytes = (USBCNTH << 8) | USBCNTL;
+    stats.usb_out_packets++;
     if (usb_out_bytes == 0) {
-      USBINDEX = USB_OUT_EP;
+      USBINDEX = usb_out_ep;
       USBCSOL &= ~USBCSOL_OUTPKT_RDY;
-      return USB_READ_AGAIN;
+      return 0;
     }
   }
-  --usb_out_bytes;
-  c = USBFIFO[USB_OUT_EP << 1];
+  return 1;
+}
+
+// Account for n bytes read from the OUT packet, releasing it when used up
+static void usb_out_used(uint8_t n)
+{
+  usb_out_bytes -= n;
   if (usb_out_bytes == 0) {
-    USBINDEX = USB_OUT_EP;
+    USBINDEX = usb_out_ep;
     USBCSOL &= ~USBCSOL_OUTPKT_RDY;
   }
+}
+
+char usb_pollchar()
+{
+  char c;
+  if (!usb_out_ready())
+    return USB_READ_AGAIN;
+  c = USBFIFO[usb_out_ep << 1];
+  usb_out_used(1);
   return c;
 }
 
+// Copy what is left of the current OUT packet into buff, up to len bytes and
+// stopping after a newline. Returns the number of bytes copied, 0 if the host
+// hasn't sent anything.
+uint8_t usb_read_chunk(__xdata char *buff, uint8_t len)
+{
+  if (!usb_out_ready())
+    return 0;
+  if (len > usb_out_bytes)
+    len = usb_out_bytes;
+  len = xmem_line_from_fifo((__xdata uint8_t *) buff, &USBFIFO[usb_out_ep << 1], len);
+  usb_out_used(len);
+  return len;
+}
+
+static void usb_discard_ep(uint8_t ep)
+{
+  // Release every packet waiting, both halves of the double buffer
+  while (1) {
+    USBINDEX = ep;
+    if ((USBCSOL & USBCSOL_OUTPKT_RDY) == 0)
+      break;
+    USBCSOL &= ~USBCSOL_OUTPKT_RDY;
+  }
+}
+
+// Throw away any data the host has sent that hasn't been read yet
+void usb_discard()
+{
+  usb_out_bytes = 0;
+  usb_discard_ep(USB_OUT_EP);
+#ifdef USB_VENDOR_BULK
+  usb_discard_ep(USB_VENDOR_OUT_EP);
+#endif
+}
+
 char usb_getchar()
 {
   char c;
   while ((c = usb_pollchar()) == USB_READ_AGAIN)
   {
-    while (!(USBOIF & (1 << USB_OUT_EP))) {}
+    while (!(USBOIF & USB_OUT_EP_MASK)) {}
   }
   return c;
 }
@@ -418,6 +679,7 @@ void usb_init()
   // Init ep0
 	usb_ep0_state = USB_EP0_IDLE;
 	usb_iif = 0;
+	usb_serial_init();
 	usb_enable();
 }
 
@@ -27,11 +27,24 @@ void usb_init();
 void usb_disable();
 void usb_enable();
 char usb_getchar();
+char usb_pollchar();
+uint8_t usb_read_chunk(__xdata char *buff, uint8_t len);
 void usb_putchar(char c);
 void usb_flush();
 
 void usb_putstr(char* buff);
 void usb_readline(char* buff);
+uint8_t usb_notify_status(uint8_t status, uint8_t page);
+void usb_discard();
+void usb_serial_init();
+uint32_t usb_linktest(uint8_t mode, uint32_t len);
+
+// Non-zero if record results go on the interrupt endpoint, see
+// IHX_RECORD_STATUS_MODE. Cleared again by a bus reset or a new configuration.
+extern __xdata uint8_t usb_status_notify;
+
+// Non-zero once the host has configured the device
+extern __xdata uint8_t usb_configuration;
 
 // End external interface
 
@@ -80,11 +93,26 @@ void usb_isr() __interrupt 6;
 #define USB_GET_DESC_TYPE(x)  (((x)>>8)&0xFF)
 #define USB_GET_DESC_INDEX(x) ((x)&0xFF)
 
+// Uncomment to add a vendor specific interface with its own pair of bulk
+// endpoints alongside the CDC ACM interface. Host tools can then talk to the
+// bootloader through libusb without going through the CDC/tty layer. The
+// vendor interface gets the big EP4/EP5 FIFOs so both directions are double
+// buffered, the CDC data interface moves to EP2/EP3.
+//#define USB_VENDOR_BULK
+
 #define USB_CONTROL_EP    0
 #define USB_INT_EP        1
+#ifdef USB_VENDOR_BULK
+#define USB_IN_EP         2
+#define USB_OUT_EP        3
+#define USB_VENDOR_OUT_EP 4
+#define USB_VENDOR_IN_EP  5
+#else
 #define USB_OUT_EP        4
 #define USB_IN_EP         5
+#endif
 #define USB_CONTROL_SIZE  32
+#define USB_INT_SIZE      8
 
 // Double buffer IN and OUT EPs, so each
 // gets half of the available space
@@ -94,6 +122,11 @@ void usb_isr() __interrupt 6;
 #define USB_IN_SIZE   64
 #define USB_OUT_SIZE  64
 
+// The vendor interface uses the same packet size, bulk endpoints can't go any
+// bigger at full speed, but EP4 and EP5 have room to double buffer it.
+#define USB_VENDOR_IN_SIZE   64
+#define USB_VENDOR_OUT_SIZE  64
+
 #define USB_EP0_IDLE      0
 #define USB_EP0_DATA_IN   1
 #define USB_EP0_DATA_OUT  2
@@ -108,6 +141,50 @@ void usb_isr() __interrupt 6;
 #define GET_LINE_CODING         0x21
 #define SET_CONTROL_LINE_STATE  0x22
 
+// Record results sent on the interrupt endpoint by usb_notify_status(). They
+// look like a CDC notification with a vendor code so the host's CDC driver
+// ignores them:
+// A1 CB ss qq 00 pp 00 00
+// ss - Result code as an ASCII digit, as it would be sent on the bulk pipe
+// qq - Sequence number, counting up from 0 once the host configures the device
+// pp - Page the writes just moved on from, now complete, or FF if none
+#define USB_NOTIFY_STATUS  0xCB
+// Sleep timer ticks to wait for the host to collect a notification before
+// giving up and going back to the bulk pipe, about 100 ms
+#define USB_NOTIFY_TIMEOUT 3200
+
+// Vendor control requests to the device, handled on EP0 so they don't wait
+// behind data queued on the bulk pipe
+// STATUS returns struct usb_vendor_status
+#define VENDOR_REQ_STATUS       0x01
+// ABORT drops any bulk data waiting and any partly received record, lets the
+// flash writes already queued finish and stops erasing ahead
+#define VENDOR_REQ_ABORT        0x02
+// ERASE_RANGE erases pages wValue to wIndex, skipping blank pages
+#define VENDOR_REQ_ERASE_RANGE  0x03
+// RUN starts the user code
+#define VENDOR_REQ_RUN          0x04
+
+// Progress of the bootloader, kept up to date by the main loop
+struct usb_vendor_status {
+  uint16_t  records;  // Records answered since power up
+  uint8_t   result;   // Result code of the last one, as an ASCII digit
+  uint8_t   page;     // Last page the writes moved on from, or 0xFF
+  uint8_t   pending;  // Vendor request not yet carried out, or 0
+};
+
+extern __xdata struct usb_vendor_status usb_vendor_status;
+// Vendor request for the main loop to carry out, and its wValue and wIndex
+extern volatile __xdata uint8_t usb_vendor_cmd;
+extern __xdata uint8_t usb_vendor_arg[2];
+
+// Modes for usb_linktest(), see IHX_RECORD_LINKTEST
+#define USB_LINKTEST_SINK    0
+#define USB_LINKTEST_ECHO    1
+#define USB_LINKTEST_SOURCE  2
+// Sleep timer ticks without a packet moving before the test gives up, ~1 s
+#define USB_LINKTEST_IDLE    32000
+
 // Data structure for GET_LINE_CODING / SET_LINE_CODING class requests
 struct usb_line_coding {
   uint32_t  rate;
@@ -129,7 +206,8 @@ struct usb_line_coding {
 #define USB_iProduct_LEN 0x1C
 #define USB_iProduct_STRING "CC Bootloader"
 #define USB_iProduct_UCS2 'C', 0, 'C', 0, ' ', 0, 'B', 0, 'o', 0, 'o', 0, 't', 0, 'l', 0, 'o', 0, 'a', 0, 'd', 0, 'e', 0, 'r', 0
-// iSerial
+// iSerial, used unless a serial number is provisioned at SERIAL_ADDR
+#define USB_iSerial_INDEX 3
 #define USB_iSerial_LEN 0x0e
 #define USB_iSerial_STRING "000001"
 #define USB_iSerial_UCS2 '0', 0, '0', 0, '0', 0, '0', 0, '0', 0, '1', 0
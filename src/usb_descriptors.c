@@ -43,8 +43,13 @@ __code __at(0x00aa) uint8_t usb_descriptors [] =
   // Configuration descriptor
   0x09,
   USB_DESC_CONFIGURATION,
+#ifdef USB_VENDOR_BULK
+  LE_WORD(90),  // wTotalLength
+  0x03,         // bNumInterfaces
+#else
   LE_WORD(67),  // wTotalLength
   0x02,         // bNumInterfaces
+#endif
   0x01,         // bConfigurationValue
   0x00,         // iConfiguration
   0xC0,         // bmAttributes
@@ -122,6 +127,35 @@ __code __at(0x00aa) uint8_t usb_descriptors [] =
   LE_WORD(USB_IN_SIZE), // wMaxPacketSize
   0x00,                 // bInterval
 
+#ifdef USB_VENDOR_BULK
+  // Vendor specific interface descriptor
+  0x09,
+  USB_DESC_INTERFACE,
+  0x02, // bInterfaceNumber
+  0x00, // bAlternateSetting
+  0x02, // bNumEndPoints
+  0xFF, // bInterfaceClass = vendor specific
+  0x00, // bInterfaceSubClass
+  0x00, // bInterfaceProtocol
+  0x00, // iInterface
+
+  // Vendor EP OUT
+  0x07,
+  USB_DESC_ENDPOINT,
+  USB_VENDOR_OUT_EP,            // bEndpointAddress
+  0x02,                         // bmAttributes = bulk
+  LE_WORD(USB_VENDOR_OUT_SIZE), // wMaxPacketSize
+  0x00,                         // bInterval
+
+  // Vendor EP IN
+  0x07,
+  USB_DESC_ENDPOINT,
+  USB_VENDOR_IN_EP|0x80,       // bEndpointAddress
+  0x02,                        // bmAttributes = bulk
+  LE_WORD(USB_VENDOR_IN_SIZE), // wMaxPacketSize
+  0x00,                        // bInterval
+
+#endif
   // String descriptors
   0x04,
   USB_DESC_STRING,
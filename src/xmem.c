@@ -0,0 +1,187 @@
+/*
+ * CC Bootloader - XDATA block copy and fill
+ *
+ * Fergus Noble (c) 2011
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#include "cc1111.h"
+#include "xmem.h"
+
+// Second data pointer and the select register. DPS bit 0 picks which pointer
+// MOVX and INC DPTR use, the unused bits read as zero so INC/DEC flip it.
+#define XMEM_DPL1 0x84
+#define XMEM_DPH1 0x85
+#define XMEM_DPS  0x92
+
+// sdcc passes the first argument in DPL/DPH, which is DPTR0 as DPS is always
+// 0 in C code. Reentrant functions get the rest on the stack, pushed last
+// argument first and low byte first, so under the return address at SP and
+// SP-1 there is the second argument at SP-2 (high byte) and SP-3 (low byte)
+// and then a third 8-bit one at SP-4. The caller takes them off again.
+//
+// Interrupt handlers don't save DPS and assume it is 0, so interrupts are
+// held off while DPTR1 is selected. The saved EA lives in the carry, which
+// none of the loop instructions touch.
+//
+// Per byte the copy loops run 6 instructions. Reading the code sdcc generates
+// for the same loop in C gives around 20, most of them loading pointers kept
+// in XDATA into DPTR and storing them back, and a generic pointer source adds
+// a call to __gptrget for every byte. That is only an estimate from counting
+// instructions, not a measurement. MOVX and the DPTR instructions don't take
+// the same number of cycles as the rest, so the ratio doesn't give the saving.
+// bootload.py bench and stats show the effect on a whole download.
+
+void xmem_copy(__xdata uint8_t *dst, __xdata uint8_t *src, uint8_t len) __reentrant __naked
+{
+  __asm
+    mov   a, sp
+    add   a, #0xfc
+    mov   r0, a
+    mov   a, @r0          ; len
+    jz    xmem_copy_done
+    mov   r2, a
+    inc   r0
+    mov   XMEM_DPL1, @r0  ; src
+    inc   r0
+    mov   XMEM_DPH1, @r0
+    mov   c, _EA
+    clr   _EA
+  xmem_copy_loop:
+    inc   XMEM_DPS
+    movx  a, @dptr
+    inc   dptr
+    dec   XMEM_DPS
+    movx  @dptr, a
+    inc   dptr
+    djnz  r2, xmem_copy_loop
+    mov   _EA, c
+  xmem_copy_done:
+    ret
+  __endasm;
+}
+
+void xmem_set(__xdata uint8_t *dst, uint8_t c, uint8_t len) __reentrant __naked
+{
+  // Only needs the one data pointer, c is at SP-2 and len at SP-3
+  __asm
+    mov   a, sp
+    add   a, #0xfd
+    mov   r0, a
+    mov   a, @r0          ; len
+    jz    xmem_set_done
+    mov   r2, a
+    inc   r0
+    mov   a, @r0          ; c
+  xmem_set_loop:
+    movx  @dptr, a
+    inc   dptr
+    djnz  r2, xmem_set_loop
+  xmem_set_done:
+    ret
+  __endasm;
+}
+
+void xmem_from_fifo(__xdata uint8_t *dst, __xdata uint8_t *fifo, uint8_t len) __reentrant __naked
+{
+  __asm
+    mov   a, sp
+    add   a, #0xfc
+    mov   r0, a
+    mov   a, @r0          ; len
+    jz    xmem_from_fifo_done
+    mov   r2, a
+    inc   r0
+    mov   XMEM_DPL1, @r0  ; fifo
+    inc   r0
+    mov   XMEM_DPH1, @r0
+    mov   c, _EA
+    clr   _EA
+  xmem_from_fifo_loop:
+    inc   XMEM_DPS
+    movx  a, @dptr
+    dec   XMEM_DPS
+    movx  @dptr, a
+    inc   dptr
+    djnz  r2, xmem_from_fifo_loop
+    mov   _EA, c
+  xmem_from_fifo_done:
+    ret
+  __endasm;
+}
+
+void xmem_to_fifo(__xdata uint8_t *fifo, __xdata uint8_t *src, uint8_t len) __reentrant __naked
+{
+  __asm
+    mov   a, sp
+    add   a, #0xfc
+    mov   r0, a
+    mov   a, @r0          ; len
+    jz    xmem_to_fifo_done
+    mov   r2, a
+    inc   r0
+    mov   XMEM_DPL1, @r0  ; src
+    inc   r0
+    mov   XMEM_DPH1, @r0
+    mov   c, _EA
+    clr   _EA
+  xmem_to_fifo_loop:
+    inc   XMEM_DPS
+    movx  a, @dptr
+    inc   dptr
+    dec   XMEM_DPS
+    movx  @dptr, a
+    djnz  r2, xmem_to_fifo_loop
+    mov   _EA, c
+  xmem_to_fifo_done:
+    ret
+  __endasm;
+}
+
+uint8_t xmem_line_from_fifo(__xdata uint8_t *dst, __xdata uint8_t *fifo, uint8_t len) __reentrant __naked
+{
+  // Count in r3, returned in DPL. XRL rather than CJNE for the newline test
+  // as CJNE would overwrite the saved EA in the carry.
+  __asm
+    mov   r3, #0
+    mov   a, sp
+    add   a, #0xfc
+    mov   r0, a
+    mov   a, @r0          ; len
+    jz    xmem_line_from_fifo_done
+    mov   r2, a
+    inc   r0
+    mov   XMEM_DPL1, @r0  ; fifo
+    inc   r0
+    mov   XMEM_DPH1, @r0
+    mov   c, _EA
+    clr   _EA
+  xmem_line_from_fifo_loop:
+    inc   XMEM_DPS
+    movx  a, @dptr
+    dec   XMEM_DPS
+    movx  @dptr, a
+    inc   dptr
+    inc   r3
+    xrl   a, #0x0a
+    jz    xmem_line_from_fifo_end
+    djnz  r2, xmem_line_from_fifo_loop
+  xmem_line_from_fifo_end:
+    mov   _EA, c
+  xmem_line_from_fifo_done:
+    mov   dpl, r3
+    ret
+  __endasm;
+}
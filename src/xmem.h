@@ -0,0 +1,40 @@
+/*
+ * CC Bootloader - XDATA block copy and fill
+ *
+ * Fergus Noble (c) 2011
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#ifndef _XMEM_H_
+#define _XMEM_H_
+
+// Byte loops sdcc compiles with one data pointer reload the pointers from
+// memory for every byte. These keep the source in the CC1111's second data
+// pointer instead. All addresses are XDATA, flash can be read through its
+// XDATA mapping. Reentrant so they are safe from the USB interrupt.
+
+// Copy len bytes from src to dst
+void xmem_copy(__xdata uint8_t *dst, __xdata uint8_t *src, uint8_t len) __reentrant;
+// Fill len bytes at dst with c
+void xmem_set(__xdata uint8_t *dst, uint8_t c, uint8_t len) __reentrant;
+// Copy len bytes out of the FIFO register at fifo
+void xmem_from_fifo(__xdata uint8_t *dst, __xdata uint8_t *fifo, uint8_t len) __reentrant;
+// Copy len bytes into the FIFO register at fifo
+void xmem_to_fifo(__xdata uint8_t *fifo, __xdata uint8_t *src, uint8_t len) __reentrant;
+// Copy up to len bytes out of the FIFO register at fifo, stopping after a
+// newline. Returns the number of bytes copied.
+uint8_t xmem_line_from_fifo(__xdata uint8_t *dst, __xdata uint8_t *fifo, uint8_t len) __reentrant;
+
+#endif // _XMEM_H_